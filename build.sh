@@ -5,13 +5,15 @@
 #------------
 
 if [[ "$OSTYPE" == "linux-gnu" ]]; then
-    g++ -o ./bin/ts_hycom ./src/ts_hycom.cpp -Wall -I/usr/include -L/usr/lib/x86_64-linux-gnu -lnetcdf_c++4
-    g++ -o ./bin/ts_hycom_readonly ./src/ts_hycom_readonly.cpp -Wall -I/usr/include -L/usr/lib/x86_64-linux-gnu -lnetcdf_c++4
-    g++ -o ./bin/uv_hycom ./src/uv_hycom.cpp -Wall -I/usr/include -L/usr/lib/x86_64-linux-gnu -lnetcdf_c++4
+    g++ -o ./bin/ts_hycom ./src/ts_hycom.cpp -std=c++11 -pthread -Wall -I/usr/include -L/usr/lib/x86_64-linux-gnu -lnetcdf_c++4 -lcurl
+    g++ -o ./bin/ts_hycom_readonly ./src/ts_hycom_readonly.cpp -std=c++11 -pthread -Wall -I/usr/include -L/usr/lib/x86_64-linux-gnu -lnetcdf_c++4 -lcurl
+    g++ -o ./bin/uv_hycom ./src/uv_hycom.cpp -std=c++11 -pthread -Wall -I/usr/include -L/usr/lib/x86_64-linux-gnu -lnetcdf_c++4 -lcurl
+    g++ -o ./bin/dap_server ./src/dap_server.cpp -std=c++11 -pthread -Wall -I/usr/include -L/usr/lib/x86_64-linux-gnu -lnetcdf_c++4 -lcurl -lz
 elif [[ "$OSTYPE" == "darwin"* ]]; then
-    g++ -o ./bin/ts_hycom ./src/ts_hycom.cpp -Wall -I/opt/local/include -L/opt/local/lib -lnetcdf_c++4
-    g++ -o ./bin/ts_hycom_readonly ./src/ts_hycom_readonly.cpp -Wall -I/opt/local/include -L/opt/local/lib -lnetcdf_c++4
-    g++ -o ./bin/uv_hycom ./src/uv_hycom.cpp -Wall -I/opt/local/include -L/opt/local/lib -lnetcdf_c++4
+    g++ -o ./bin/ts_hycom ./src/ts_hycom.cpp -std=c++11 -pthread -Wall -I/opt/local/include -L/opt/local/lib -lnetcdf_c++4 -lcurl
+    g++ -o ./bin/ts_hycom_readonly ./src/ts_hycom_readonly.cpp -std=c++11 -pthread -Wall -I/opt/local/include -L/opt/local/lib -lnetcdf_c++4 -lcurl
+    g++ -o ./bin/uv_hycom ./src/uv_hycom.cpp -std=c++11 -pthread -Wall -I/opt/local/include -L/opt/local/lib -lnetcdf_c++4 -lcurl
+    g++ -o ./bin/dap_server ./src/dap_server.cpp -std=c++11 -pthread -Wall -I/opt/local/include -L/opt/local/lib -lnetcdf_c++4 -lcurl -lz
 else
     echo "OS not supported"
 fi
@@ -0,0 +1,256 @@
+#!/bin/bash
+#------------
+# smoke test of the remote read path against a local dap_server
+#------------
+# Run after ./build.sh.  Two dap_servers serve the same synthetic
+# grid: a clean one for a plain serial reference run, and one that
+# injects 503 errors and dropped responses for the run under test
+# (--workers, --autotune, --cache, --skip-land).  The box crosses the
+# lon seam (160 to -170) and is grown from a cached west half (160 to
+# 179), so the east half is a cache hole past the seam.  Each tool and
+# lon stride must write the same data as its reference, NREC records
+# in several batches.  The server draws its faults per request, so a
+# given --seed injects the same faults on every run.  A reference run
+# is then recorded through a proxy dap_server and replayed.  Lon box
+# normalization (src/hycom_tiles.h) and the tensor layouts of
+# src/hycom_tensor.h are checked last.
+#
+#   ./smoke_test.sh [PORT]     (uses PORT to PORT+3, default 8760)
+
+cd "$(dirname "$0")"
+ROOT=$(pwd)
+PORT=${1:-8760}
+WORK=$(mktemp -d)
+mkdir -p "$WORK/bin" "$WORK/data"
+FAILED=0
+SERVERS=""
+
+cleanup(){
+    [ -n "$SERVERS" ] && kill $SERVERS 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+for b in ts_hycom uv_hycom dap_server; do
+    if [ ! -x "./bin/$b" ]; then
+        echo "(!) ./bin/$b MISSING: RUN ./build.sh FIRST"
+        exit 1
+    fi
+done
+
+GRID=16,40,201,301
+./bin/dap_server --synthetic=$GRID --port=$PORT > "$WORK/clean.log" 2>&1 &
+SERVERS="$!"
+./bin/dap_server --synthetic=$GRID --port=$((PORT+1)) --seed=7 \
+    --error-rate=0.05 --drop-rate=0.05 > "$WORK/faulty.log" 2>&1 &
+SERVERS="$SERVERS $!"
+sleep 1
+CLEAN=http://127.0.0.1:$PORT/thredds/dodsC/GLBv0.08/synthetic
+FAULTY=http://127.0.0.1:$((PORT+1))/thredds/dodsC/GLBv0.08/synthetic
+BOX=("--tstart=[2018:01:01]" "--tstop=[2018:01:02]" --depthmin=0
+     --depthmax=100 --latmin=0 --latmax=20 --newfile=true)
+NREC=9 # 3-hourly records from 2018-01-01 00:00 to 2018-01-02 00:00
+
+# run TOOL LOG ARGS... : extract in $WORK/bin, output in $WORK/data
+run(){
+    local tool=$1 log=$2
+    shift 2
+    (cd "$WORK/bin" && "$ROOT/bin/$tool" "${BOX[@]}" "$@" > "$WORK/$log" 2>&1)
+}
+
+# data section of a NetCDF file (global attributes may differ)
+data(){
+    ncdump "$1" | sed -n '/^data:/,$p'
+}
+
+# records in a NetCDF file
+records(){
+    ncdump -h "$1" | sed -n 's/^[[:space:]]*time = \([0-9]*\) ;.*/\1/p'
+}
+
+for tool in ts_hycom uv_hycom; do
+    out=$WORK/data/salt_temp_4D.nc
+    [ $tool = uv_hycom ] && out=$WORK/data/velocity_4D.nc
+    for stride in 1 2; do
+        name="$tool lon-stride=$stride"
+        rm -rf "$WORK/cache" "$WORK/meta"
+
+        # reference: clean server, serial
+        if ! run $tool ref.log --source=$CLEAN --meta-cache=off \
+                --prefetch=1 --lon-stride=$stride --lonmin=160 --lonmax=-170
+        then
+            echo "FAIL $name: reference run (see below)"
+            tail -5 "$WORK/ref.log"
+            FAILED=1
+            continue
+        fi
+        mv "$out" "$WORK/ref.nc"
+        if [ "$(records "$WORK/ref.nc")" != "$NREC" ]; then
+            echo "FAIL $name: $(records "$WORK/ref.nc") records, not $NREC"
+            FAILED=1
+            continue
+        fi
+
+        # under test: faulty server, west half first, then the whole box
+        opts="--source=$FAULTY --meta-cache=$WORK/meta --workers=4
+              --autotune=true --cache=$WORK/cache --skip-land=true
+              --tile-bytes=0.05 --records-per-read=2 --lon-stride=$stride"
+        if ! run $tool west.log $opts --lonmin=160 --lonmax=179 ||
+           ! run $tool test.log $opts --lonmin=160 --lonmax=-170
+        then
+            echo "FAIL $name: run under test (see below)"
+            tail -5 "$WORK/west.log" "$WORK/test.log"
+            FAILED=1
+            continue
+        fi
+        retries=$(cat "$WORK/west.log" "$WORK/test.log" |
+                  grep -c "FETCH FAILED")
+        if [ "$(data "$out")" != "$(data "$WORK/ref.nc")" ]; then
+            echo "FAIL $name: output differs from the serial run"
+            FAILED=1
+        else
+            echo "ok   $name ($retries retried batches)"
+        fi
+    done
+done
+
+# Record a serial run through a proxy, then replay it at full speed
+ARCHIVE=$WORK/archive
+./bin/dap_server --port=$((PORT+2)) --record=$ARCHIVE \
+    --upstream=http://127.0.0.1:$PORT > "$WORK/record.log" 2>&1 &
+RECORDER=$!
+SERVERS="$SERVERS $RECORDER"
+sleep 1
+rm -rf "$WORK/data"/*
+if run ts_hycom recorded.log --prefetch=1 --meta-cache=off \
+       --source=http://127.0.0.1:$((PORT+2))/thredds/dodsC/GLBv0.08/synthetic \
+       --lonmin=160 --lonmax=-170
+then
+    mv "$WORK/data/salt_temp_4D.nc" "$WORK/recorded.nc"
+    kill $RECORDER
+    ./bin/dap_server --port=$((PORT+3)) --replay=$ARCHIVE --timing=fast \
+        > "$WORK/replay.log" 2>&1 &
+    SERVERS="$SERVERS $!"
+    sleep 1
+    if ! run ts_hycom replayed.log --prefetch=1 --meta-cache=off \
+         --source=http://127.0.0.1:$((PORT+3))/thredds/dodsC/GLBv0.08/synthetic \
+         --lonmin=160 --lonmax=-170
+    then
+        echo "FAIL record/replay: replayed run (see below)"
+        tail -5 "$WORK/replayed.log"
+        FAILED=1
+    elif [ "$(data "$WORK/data/salt_temp_4D.nc")" != \
+           "$(data "$WORK/recorded.nc")" ]; then
+        echo "FAIL record/replay: replayed output differs"
+        FAILED=1
+    else
+        echo "ok   record/replay ($(ls "$ARCHIVE" | grep -c body) exchanges)"
+    fi
+else
+    echo "FAIL record/replay: recorded run (see below)"
+    tail -5 "$WORK/recorded.log"
+    FAILED=1
+fi
+
+# Lon boxes on -180:180 and 0:360 grids
+cat > "$WORK/lon.cpp" <<'EOF'
+#include <iostream>
+#include "hycom_tiles.h"
+
+// normalizeLonBox(lon_min, lon_max) on a grid from lon0 to lon_last
+bool expect(float lon_min, float lon_max, float lon0, float lon_last,
+            float want_min, float want_max, bool want_wrap)
+{
+  float lo = lon_min, hi = lon_max;
+  bool wrap = normalizeLonBox(lo, hi, lon0, lon_last);
+  bool ok = (lo == want_min) && (hi == want_max) && (wrap == want_wrap);
+  std::cout << (ok ? "ok   " : "FAIL ") << "lon box " << lon_min << ":"
+            << lon_max << " on " << lon0 << ":" << lon_last << " -> " << lo
+            << ":" << hi << (wrap ? " across the seam" : "") << std::endl;
+  return ok;
+}
+
+int main()
+{
+  bool ok = true;
+  // -180:180 grid
+  ok = expect(-170, -160, -180, 179.92f, -170, -160, false) && ok;
+  ok = expect(200, 210, -180, 179.92f, -160, -150, false) && ok;
+  ok = expect(170, -170, -180, 179.92f, 170, -170, true) && ok;
+  ok = expect(170, 190, -180, 179.92f, 170, -170, true) && ok;
+  ok = expect(-180, 180, -180, 179.92f, -180, 179.92f, false) && ok;
+  // 0:360 grid
+  ok = expect(-170, -160, 0, 359.92f, 190, 200, false) && ok;
+  ok = expect(200, 210, 0, 359.92f, 200, 210, false) && ok;
+  ok = expect(350, 10, 0, 359.92f, 350, 10, true) && ok;
+  ok = expect(-10, 10, 0, 359.92f, 350, 10, true) && ok;
+  ok = expect(0, 360, 0, 359.92f, 0, 359.92f, false) && ok;
+  return ok ? 0 : 1;
+}
+EOF
+if ! g++ -std=c++11 -I./src -o "$WORK/lon" "$WORK/lon.cpp" ||
+   ! "$WORK/lon"; then
+    FAILED=1
+fi
+
+# Tensor layouts: blocked transpose() against element-wise copies
+cat > "$WORK/tensor.cpp" <<'EOF'
+#include <iostream>
+#include <chrono>
+#include "hycom_tensor.h"
+
+template <class L>
+bool check(const Tensor4<float> &a, const char *name)
+{
+  Tensor4<float, L> b(a.extent(0), a.extent(1), a.extent(2), a.extent(3));
+  Tensor4<float, L> c(a.extent(0), a.extent(1), a.extent(2), a.extent(3));
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  transpose(a, b);
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  for (size_t t=0; t<a.extent(0); t++)
+    for (size_t z=0; z<a.extent(1); z++)
+      for (size_t y=0; y<a.extent(2); y++)
+        for (size_t x=0; x<a.extent(3); x++)
+          c(t, z, y, x) = a(t, z, y, x);
+  std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+  bool same = true;
+  for (size_t t=0; t<a.extent(0); t++)
+    for (size_t z=0; z<a.extent(1); z++)
+      for (size_t y=0; y<a.extent(2); y++)
+        for (size_t x=0; x<a.extent(3); x++)
+          same = same && (b(t, z, y, x) == a(t, z, y, x));
+  // records as written to the output file
+  std::vector<float> scratch(a.recordSize());
+  for (size_t t=0; t<a.extent(0); t++){
+    const float *rec = b.recordTZYX(t, &scratch[0]);
+    same = same && std::equal(rec, rec + a.recordSize(),
+                              a.data() + t*a.recordSize());
+  }
+  std::cout << (same ? "ok   " : "FAIL ") << "transpose to " << name
+            << ": blocked " << std::chrono::duration<double>(t1-t0).count()
+            << " s, element-wise "
+            << std::chrono::duration<double>(t2-t1).count() << " s"
+            << std::endl;
+  return same;
+}
+
+int main()
+{
+  Tensor4<float> a(4, 40, 251, 301);
+  for (size_t i=0; i<a.size(); i++)
+    a.data()[i] = (float)i;
+  bool ok = check<LayoutTYXZ>(a, "TYXZ");
+  ok = check<LayoutTiled<32> >(a, "Tiled<32>") && ok;
+  return ok ? 0 : 1;
+}
+EOF
+if ! g++ -O2 -std=c++11 -I./src -o "$WORK/tensor" "$WORK/tensor.cpp" ||
+   ! "$WORK/tensor"; then
+    FAILED=1
+fi
+
+if [ $FAILED -ne 0 ]; then
+    echo "SMOKE TEST FAILED"
+    exit 1
+fi
+echo "SMOKE TEST PASSED"
@@ -0,0 +1,1333 @@
+/************************************************************/
+/*    FILE: dap_server.cpp                                  */
+/************************************************************/
+
+// Local stand-in for the tds.hycom.org OPeNDAP server.
+//
+// Serves one dataset over DAP2 ('.dds', '.das' and '.dods' requests)
+// on localhost: either synthetic HYCOM-shaped fields computed on the
+// fly, or the variables of a local NetCDF file.  Injected latency,
+// bandwidth caps and errors make the remote read path of ts_hycom and
+// uv_hycom benchmarkable offline and reproducible:
+//
+//   ./bin/dap_server --synthetic --latency=150 --bandwidth=4 &
+//   ./bin/ts_hycom --source=http://127.0.0.1:8080/GLBv0.08/synthetic ...
+//
+// Any path is accepted; only the suffix selects the response.
+//
+// Record and replay: with --record the server is a proxy that passes
+// every request on to the real server and keeps the exchange in an
+// archive; with --replay it serves an archive back, with the recorded
+// timing or at full speed, so one production extraction can be rerun
+// byte-for-byte against each fetch strategy.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <csignal>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <netcdf>
+#include "hycom_dap.h"
+
+using namespace std;
+using namespace netCDF;
+using namespace netCDF::exceptions;
+
+static const int NC_ERR = 2;
+
+//---------------------------------------------------------------
+// 1. DATASETS
+//---------------------------------------------------------------
+
+// Attribute values are kept as DAS text: numbers as printed, strings
+// quoted
+struct Att {
+  string name, type;          // DAP type: String, Int16, Float32, ...
+  vector<string> values;
+};
+
+struct Var {
+  string name, type;          // DAP type of the values
+  vector<string> dims;
+  vector<size_t> shape;
+  vector<Att> atts;
+};
+
+class Dataset
+{
+ public:
+  virtual ~Dataset() {}
+
+  // Values of 'var' over a hyperslab of its innermost (up to two)
+  // dimensions; 'outer' holds the indices of the other dimensions
+  virtual void plane(const Var &var, const vector<size_t> &outer,
+                     const size_t *start, const size_t *count,
+                     const size_t *stride, vector<double> &out) = 0;
+
+  const string&      name()    const { return m_name; }
+  const vector<Var>& vars()    const { return m_vars; }
+  const vector<Att>& globals() const { return m_globals; }
+
+  const Var* find(const string &name) const
+  {
+    for (size_t v=0; v<m_vars.size(); v++)
+      if (m_vars[v].name == name)
+        return &m_vars[v];
+    return NULL;
+  }
+
+ protected:
+  string      m_name;
+  vector<Var> m_vars;
+  vector<Att> m_globals;
+};
+
+static string quoted(const string &s)
+{
+  string q = "\"";
+  for (size_t i=0; i<s.size(); i++){
+    if ((s[i] == '"') || (s[i] == '\\'))
+      q += '\\';
+    q += s[i];
+  }
+  return q + "\"";
+}
+
+static Att textAtt(const string &name, const string &value)
+{
+  Att a;
+  a.name = name;
+  a.type = "String";
+  a.values.push_back(quoted(value));
+  return a;
+}
+
+static Att numAtt(const string &name, const string &type, double value)
+{
+  ostringstream s;
+  s.precision(9);
+  s << value;
+  Att a;
+  a.name = name;
+  a.type = type;
+  a.values.push_back(s.str());
+  return a;
+}
+
+//---------------------------------------------------------------
+// 1.1: Synthetic HYCOM look-alike
+// 3-hourly records from 2018-01-01 on the 40 standard depths and a
+// uniform lat/lon grid.  Fields are smooth functions of position and
+// time, packed like HYCOM (scale 0.001, missing -30000); land is
+// missing, and there is more of it deeper down.
+class SyntheticDataset : public Dataset
+{
+ public:
+  SyntheticDataset(size_t nt, size_t nz, size_t ny, size_t nx)
+    : m_ny(ny), m_nx(nx)
+  {
+    m_name = "GLBv0.08/synthetic";
+    axis("time", nt, "hours since 2000-01-01 00:00:00");
+    axis("depth", nz, "m");
+    axis("lat", ny, "degrees_north");
+    axis("lon", nx, "degrees_east");
+    field("salinity", "psu", 20);
+    field("water_temp", "degC", 20);
+    field("water_u", "m/s", 0);
+    field("water_v", "m/s", 0);
+    m_globals.push_back(textAtt("title",
+                                "synthetic HYCOM fields (dap_server)"));
+  }
+
+  void plane(const Var &var, const vector<size_t> &outer,
+             const size_t *start, const size_t *count,
+             const size_t *stride, vector<double> &out)
+  {
+    if (var.shape.size() == 1){
+      out.resize(count[0]);
+      for (size_t i=0; i<count[0]; i++)
+        out[i] = coord(var.name, start[0] + i*stride[0]);
+      return;
+    }
+    double hours = coord("time", outer[0]);
+    double depth = coord("depth", outer[1]);
+    int kind = (var.name == "salinity") ? 0 : (var.name == "water_temp") ? 1
+             : (var.name == "water_u") ? 2 : 3;
+    double offset = (kind < 2) ? 20 : 0;
+    vector<double> lon(count[1]), lon_land(count[1]), lon_term(count[1]);
+    for (size_t i=0; i<count[1]; i++){
+      lon[i] = coord("lon", start[1] + i*stride[1]);
+      lon_land[i] = cos(lon[i]*0.07);
+      lon_term[i] = (kind == 0) ? 0.6*sin(lon[i]*0.02)
+                  : (kind == 3) ? 0.4*sin(lon[i]*0.1) : 0;
+    }
+    double decay = exp(-depth/500);
+    out.resize(count[0]*count[1]);
+    for (size_t j=0, n=0; j<count[0]; j++){
+      double lat = coord("lat", start[0] + j*stride[0]);
+      double land = 1.6 - depth/2500 - sin(lat*0.11);
+      double row = (kind == 0) ? 34.5 + 0.3*cos(lat*0.05) + depth/5000
+        : (kind == 1) ? max(28*cos(lat*M_PI/180)*exp(-depth/800)
+                            + 0.5*sin(2*M_PI*hours/24), -1.8)
+        : (kind == 2) ? 0.6*cos(lat*0.1)*decay*cos(2*M_PI*hours/12.42)
+        : decay*sin(2*M_PI*hours/12.42);
+      for (size_t i=0; i<count[1]; i++, n++){
+        if (lon_land[i] > land){
+          out[n] = MISSING;
+          continue;
+        }
+        double v = (kind == 0) ? row + lon_term[i]
+                 : (kind == 3) ? row*lon_term[i] : row;
+        out[n] = lround((v - offset)/0.001);
+      }
+    }
+  }
+
+ private:
+  static const int MISSING = -30000;
+
+  double coord(const string &axis, size_t i) const
+  {
+    static const double depths[40] = {
+      0, 2, 4, 6, 8, 10, 12, 15, 20, 25, 30, 35, 40, 45, 50, 60, 70, 80,
+      90, 100, 125, 150, 200, 250, 300, 350, 400, 500, 600, 700, 800, 900,
+      1000, 1250, 1500, 2000, 2500, 3000, 4000, 5000};
+    if (axis == "time")
+      return 157800 + 3.0*i; // 2018-01-01 00:00
+    if (axis == "depth")
+      return (i < 40) ? depths[i] : 5000 + 1000.0*(i-39);
+    if (axis == "lat")
+      return (m_ny > 1) ? -80 + 170.0*i/(m_ny-1) : 0;
+    return -180 + 360.0*i/m_nx;
+  }
+
+  void axis(const string &name, size_t n, const string &units)
+  {
+    Var v;
+    v.name = name;
+    v.type = "Float64";
+    v.dims.push_back(name);
+    v.shape.push_back(n);
+    v.atts.push_back(textAtt("units", units));
+    if (name == "time")
+      v.atts.push_back(textAtt("calendar", "gregorian"));
+    m_vars.push_back(v);
+  }
+
+  void field(const string &name, const string &units, double offset)
+  {
+    Var v;
+    v.name = name;
+    v.type = "Int16";
+    for (size_t d=0; d<4; d++){
+      v.dims.push_back(m_vars[d].name);
+      v.shape.push_back(m_vars[d].shape[0]);
+    }
+    v.atts.push_back(textAtt("units", units));
+    v.atts.push_back(numAtt("scale_factor", "Float32", 0.001));
+    v.atts.push_back(numAtt("add_offset", "Float32", offset));
+    v.atts.push_back(numAtt("missing_value", "Int16", MISSING));
+    v.atts.push_back(numAtt("_FillValue", "Int16", MISSING));
+    m_vars.push_back(v);
+  }
+
+  size_t m_ny, m_nx;
+};
+
+//---------------------------------------------------------------
+// 1.2: Local NetCDF file
+// Every numeric variable with at least one dimension is served with
+// its attributes; reads go straight to the file.
+class FileDataset : public Dataset
+{
+ public:
+  FileDataset(const string &path) : m_file(path, NcFile::read)
+  {
+    m_name = path.substr(path.find_last_of('/') + 1);
+    multimap<string,NcVar> vars = m_file.getVars();
+    for (multimap<string,NcVar>::iterator it=vars.begin();
+         it!=vars.end(); ++it){
+      NcVar nv = it->second;
+      Var v;
+      v.name = it->first;
+      v.type = dapType(nv.getType());
+      if (v.type.empty() || (nv.getDimCount() == 0))
+        continue; // text, user types and scalars
+      vector<NcDim> dims = nv.getDims();
+      for (size_t d=0; d<dims.size(); d++){
+        v.dims.push_back(dims[d].getName());
+        v.shape.push_back(dims[d].getSize());
+      }
+      map<string,NcVarAtt> atts = nv.getAtts();
+      for (map<string,NcVarAtt>::iterator a=atts.begin(); a!=atts.end(); ++a)
+        addAtt(v.atts, a->second);
+      m_vars.push_back(v);
+      m_ncvars.push_back(nv);
+    }
+    multimap<string,NcGroupAtt> gatts = m_file.getAtts();
+    for (multimap<string,NcGroupAtt>::iterator a=gatts.begin();
+         a!=gatts.end(); ++a)
+      addAtt(m_globals, a->second);
+  }
+
+  void plane(const Var &var, const vector<size_t> &outer,
+             const size_t *start, const size_t *count,
+             const size_t *stride, vector<double> &out)
+  {
+    size_t rank = var.shape.size();
+    size_t nouter = outer.size();
+    vector<size_t> st(rank), ct(rank, 1);
+    vector<ptrdiff_t> sd(rank, 1);
+    size_t n = 1;
+    for (size_t d=0; d<rank; d++){
+      if (d < nouter){
+        st[d] = outer[d];
+        continue;
+      }
+      st[d] = start[d-nouter];
+      ct[d] = count[d-nouter];
+      sd[d] = stride[d-nouter];
+      n *= ct[d];
+    }
+    out.resize(n);
+    lock_guard<mutex> lock(m_mutex); // netcdf-c is not thread-safe
+    m_ncvars[&var - &m_vars[0]].getVar(st, ct, sd, &out[0]);
+  }
+
+ private:
+  static string dapType(const NcType &type)
+  {
+    if ((type == ncByte) || (type == ncUbyte)) return "Byte";
+    if (type == ncShort)  return "Int16";
+    if (type == ncUshort) return "UInt16";
+    if (type == ncInt)    return "Int32";
+    if (type == ncUint)   return "UInt32";
+    if (type == ncFloat)  return "Float32";
+    if (type == ncDouble) return "Float64";
+    return "";
+  }
+
+  static void addAtt(vector<Att> &atts, const NcAtt &att)
+  {
+    Att a;
+    a.name = att.getName();
+    if ((att.getType() == ncChar) || (att.getType() == ncString)){
+      string text;
+      att.getValues(text);
+      atts.push_back(textAtt(a.name, text));
+      return;
+    }
+    a.type = dapType(att.getType());
+    if (a.type.empty())
+      return;
+    vector<double> values(att.getAttLength());
+    if (values.empty())
+      return;
+    att.getValues(&values[0]);
+    for (size_t i=0; i<values.size(); i++){
+      ostringstream s;
+      s.precision(9);
+      s << values[i];
+      a.values.push_back(s.str());
+    }
+    atts.push_back(a);
+  }
+
+  NcFile         m_file;
+  vector<NcVar>  m_ncvars;
+  mutex          m_mutex;
+};
+
+
+//---------------------------------------------------------------
+// 2. CONSTRAINTS
+//---------------------------------------------------------------
+struct Projection {
+  const Var *var;
+  vector<size_t> start, count, stride;
+};
+
+static string urlDecode(const string &s)
+{
+  string out;
+  for (size_t i=0; i<s.size(); i++){
+    if ((s[i] == '%') && (i+2 < s.size())){
+      out += (char)strtol(s.substr(i+1, 2).c_str(), NULL, 16);
+      i += 2;
+    }
+    else
+      out += s[i];
+  }
+  return out;
+}
+
+// Projection list of a DAP2 constraint, e.g. "lat,salinity[0][0:2:38]";
+// a variable without brackets (or missing trailing ones) is read whole
+static bool parseConstraint(const Dataset &ds, const string &ce,
+                            vector<Projection> &proj, string &error)
+{
+  string list = urlDecode(ce);
+  list = list.substr(0, list.find('&')); // selections are not supported
+  if (list.empty()){
+    for (size_t v=0; v<ds.vars().size(); v++){
+      const Var &var = ds.vars()[v];
+      Projection p;
+      p.var = &var;
+      p.start.assign(var.shape.size(), 0);
+      p.count = var.shape;
+      p.stride.assign(var.shape.size(), 1);
+      proj.push_back(p);
+    }
+    return true;
+  }
+
+  istringstream items(list);
+  string item;
+  while (getline(items, item, ',')){
+    size_t b = item.find('[');
+    string name = item.substr(0, b);
+    name = name.substr(name.rfind('.') + 1); // Grid member "v.v"
+    const Var *var = ds.find(name);
+    if (!var){
+      error = "No such variable: " + name;
+      return false;
+    }
+    Projection p;
+    p.var = var;
+    p.start.assign(var->shape.size(), 0);
+    p.count = var->shape;
+    p.stride.assign(var->shape.size(), 1);
+    for (size_t d=0; b != string::npos; d++){
+      size_t e = item.find(']', b);
+      if ((e == string::npos) || (d >= var->shape.size())){
+        error = "Bad hyperslab: " + item;
+        return false;
+      }
+      unsigned long lo, st = 1, hi;
+      string range = item.substr(b+1, e-b-1);
+      int n = sscanf(range.c_str(), "%lu:%lu:%lu", &lo, &st, &hi);
+      if (n == 1)
+        hi = lo;
+      else if (n == 2){
+        hi = st;
+        st = 1;
+      }
+      if ((n < 1) || (st < 1) || (hi < lo) || (hi >= var->shape[d])){
+        error = "Bad hyperslab: " + item;
+        return false;
+      }
+      p.start[d] = lo;
+      p.stride[d] = st;
+      p.count[d] = (hi - lo)/st + 1;
+      b = (e+1 < item.size()) ? e+1 : string::npos;
+      if ((b != string::npos) && (item[b] != '[')){
+        error = "Bad hyperslab: " + item;
+        return false;
+      }
+    }
+    proj.push_back(p);
+  }
+  return true;
+}
+
+
+//---------------------------------------------------------------
+// 3. HTTP REPLIES
+//---------------------------------------------------------------
+struct Emulation {
+  double latency;     // s before each response
+  double bandwidth;   // bytes/s per connection, 0 = no cap
+  double error_rate;  // fraction of requests answered with HTTP 503
+  double drop_rate;   // fraction of responses cut off mid-body
+  bool   gzip;        // honour Accept-Encoding: gzip
+};
+
+// Connection closed, by the client or by an injected drop
+struct Disconnect {};
+
+// A streamed (chunked) response, optionally gzipped, paced to the
+// bandwidth cap, and cut off after 'drop_after' bytes (-1 = never)
+class Reply
+{
+ public:
+  Reply(int fd, const Emulation &emu, bool gzip, long drop_after)
+    : m_fd(fd), m_bandwidth(emu.bandwidth), m_gzip(gzip),
+      m_drop_after(drop_after), m_body(0), m_sent(0)
+  {
+    if (m_gzip){
+      memset(&m_z, 0, sizeof(m_z));
+      deflateInit2(&m_z, 1, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+    }
+    m_start = chrono::steady_clock::now();
+  }
+
+  ~Reply()
+  {
+    if (m_gzip)
+      deflateEnd(&m_z);
+  }
+
+  void begin(int status, const string &type, const string &description)
+  {
+    ostringstream h;
+    h << "HTTP/1.1 " << status << " " << (status == 200 ? "OK" : "Error")
+      << "\r\nContent-Type: " << type
+      << "\r\nContent-Description: " << description
+      << "\r\nXDODS-Server: dods/3.2"
+      << "\r\nTransfer-Encoding: chunked\r\n";
+    if (m_gzip)
+      h << "Content-Encoding: gzip\r\n";
+    h << "\r\n";
+    string head = h.str();
+    send(head.data(), head.size());
+  }
+
+  void write(const string &data) { write(data.data(), data.size()); }
+
+  void write(const char *p, size_t n)
+  {
+    m_body += n;
+    m_buf.append(p, n);
+    if (m_buf.size() >= BLOCK)
+      flush(false);
+  }
+
+  void end()
+  {
+    flush(true);
+    send("0\r\n\r\n", 5);
+  }
+
+  double body() const { return m_body; } // bytes before compression
+  double sent() const { return m_sent; } // bytes on the wire
+
+  // Body bytes on the wire for 'data', as write() would send them
+  static double encodedSize(const string &data, bool gzip)
+  {
+    if (!gzip)
+      return data.size();
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    deflateInit2(&z, 1, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+    z.next_in = (Bytef*)data.data();
+    z.avail_in = data.size();
+    vector<char> out(BLOCK);
+    double n = 0;
+    do{
+      z.next_out = (Bytef*)&out[0];
+      z.avail_out = out.size();
+      deflate(&z, Z_FINISH);
+      n += out.size() - z.avail_out;
+    } while (z.avail_out == 0);
+    deflateEnd(&z);
+    return n;
+  }
+
+ private:
+  static const size_t BLOCK = 65536;
+
+  void flush(bool last)
+  {
+    if (!m_gzip){
+      chunk(m_buf.data(), m_buf.size());
+      m_buf.clear();
+      return;
+    }
+    m_z.next_in = (Bytef*)m_buf.data();
+    m_z.avail_in = m_buf.size();
+    vector<char> out(BLOCK);
+    do{
+      m_z.next_out = (Bytef*)&out[0];
+      m_z.avail_out = out.size();
+      deflate(&m_z, last ? Z_FINISH : Z_NO_FLUSH);
+      chunk(&out[0], out.size() - m_z.avail_out);
+    } while (m_z.avail_out == 0);
+    m_buf.clear();
+  }
+
+  void chunk(const char *p, size_t n)
+  {
+    if (n == 0)
+      return;
+    char len[32];
+    snprintf(len, sizeof(len), "%zx\r\n", n);
+    send(len, strlen(len));
+    send(p, n);
+    send("\r\n", 2);
+  }
+
+  // Raw bytes to the socket, paced to the bandwidth cap
+  void send(const char *p, size_t n)
+  {
+    while (n > 0){
+      size_t k = min(n, (size_t)16384);
+      if ((m_drop_after >= 0) && (m_sent + (long)k > m_drop_after)){
+        k = m_drop_after - m_sent;
+        ::send(m_fd, p, k, MSG_NOSIGNAL);
+        throw Disconnect();
+      }
+      ssize_t r = ::send(m_fd, p, k, MSG_NOSIGNAL);
+      if (r <= 0)
+        throw Disconnect();
+      p += r;
+      n -= r;
+      m_sent += r;
+      if (m_bandwidth > 0)
+        this_thread::sleep_until(m_start + chrono::microseconds(
+          (long long)(1e6*m_sent/m_bandwidth)));
+    }
+  }
+
+  int         m_fd;
+  double      m_bandwidth;
+  bool        m_gzip;
+  long        m_drop_after;
+  double      m_body;
+  long        m_sent;
+  string      m_buf;
+  z_stream    m_z;
+  chrono::steady_clock::time_point m_start;
+};
+
+// A complete (unstreamed) DAP2 error response
+static void errorReply(int fd, int status, const string &message)
+{
+  ostringstream body;
+  body << "Error {\n    code = " << status << ";\n    message = "
+       << quoted(message) << ";\n};\n";
+  ostringstream h;
+  h << "HTTP/1.1 " << status << " Error\r\nContent-Type: text/plain"
+    << "\r\nContent-Description: dods-error\r\nXDODS-Server: dods/3.2"
+    << "\r\nContent-Length: " << body.str().size() << "\r\n\r\n"
+    << body.str();
+  string out = h.str();
+  if (::send(fd, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size())
+    throw Disconnect();
+}
+
+
+//---------------------------------------------------------------
+// 4. DAP RESPONSES
+//---------------------------------------------------------------
+static string ddsText(const Dataset &ds, const vector<Projection> &proj)
+{
+  ostringstream s;
+  s << "Dataset {\n";
+  for (size_t p=0; p<proj.size(); p++){
+    const Var &var = *proj[p].var;
+    s << "    " << var.type << " " << var.name;
+    for (size_t d=0; d<var.dims.size(); d++)
+      s << "[" << var.dims[d] << " = " << proj[p].count[d] << "]";
+    s << ";\n";
+  }
+  s << "} " << ds.name() << ";\n";
+  return s.str();
+}
+
+static void dasAtts(ostringstream &s, const vector<Att> &atts)
+{
+  for (size_t a=0; a<atts.size(); a++){
+    s << "        " << atts[a].type << " " << atts[a].name << " ";
+    for (size_t i=0; i<atts[a].values.size(); i++)
+      s << (i > 0 ? ", " : "") << atts[a].values[i];
+    s << ";\n";
+  }
+}
+
+static string dasText(const Dataset &ds)
+{
+  ostringstream s;
+  s << "Attributes {\n";
+  for (size_t v=0; v<ds.vars().size(); v++){
+    s << "    " << ds.vars()[v].name << " {\n";
+    dasAtts(s, ds.vars()[v].atts);
+    s << "    }\n";
+  }
+  s << "    NC_GLOBAL {\n";
+  dasAtts(s, ds.globals());
+  s << "    }\n}\n";
+  return s.str();
+}
+
+static void putBE(string &buf, uint64_t x, int nbytes)
+{
+  for (int b=nbytes-1; b>=0; b--)
+    buf += (char)((x >> (8*b)) & 0xff);
+}
+
+// XDR encoding of values of DAP type 'type'; Int16 widens to 32 bits
+static void encode(const string &type, const vector<double> &vals,
+                   string &buf)
+{
+  size_t n = vals.size();
+  if (type == "Byte"){
+    for (size_t i=0; i<n; i++)
+      buf += (char)(long)vals[i];
+    return;
+  }
+  size_t width = (type == "Float64") ? 8 : 4;
+  bool real = (type == "Float32");
+  bool uns = (type[0] == 'U');
+  size_t pos = buf.size();
+  buf.resize(pos + n*width);
+  unsigned char *p = (unsigned char*)&buf[pos];
+  for (size_t i=0; i<n; i++, p+=width){
+    uint64_t x;
+    if (width == 8){
+      double d = vals[i];
+      memcpy(&x, &d, 8);
+    }
+    else if (real){
+      float f = vals[i];
+      uint32_t u;
+      memcpy(&u, &f, 4);
+      x = u;
+    }
+    else if (uns)
+      x = (uint32_t)(long long)vals[i];
+    else
+      x = (uint32_t)(int32_t)(long long)vals[i];
+    for (size_t b=0; b<width; b++)
+      p[b] = (x >> (8*(width-1-b))) & 0xff;
+  }
+}
+
+// One projected array: its length (twice), then the values, read a
+// plane of the innermost dimensions at a time
+static void writeArray(Dataset &ds, const Projection &p, Reply &reply)
+{
+  size_t rank = p.count.size();
+  size_t nouter = rank - min(rank, (size_t)2);
+  size_t n = 1;
+  for (size_t d=0; d<rank; d++)
+    n *= p.count[d];
+  string buf;
+  putBE(buf, n, 4);
+  putBE(buf, n, 4);
+
+  vector<size_t> idx(nouter, 0), outer(nouter);
+  vector<double> vals;
+  while (true){
+    for (size_t d=0; d<nouter; d++)
+      outer[d] = p.start[d] + idx[d]*p.stride[d];
+    ds.plane(*p.var, outer, &p.start[nouter], &p.count[nouter],
+             &p.stride[nouter], vals);
+    encode(p.var->type, vals, buf);
+    reply.write(buf);
+    buf.clear();
+
+    size_t d = nouter;
+    while ((d > 0) && (++idx[d-1] == p.count[d-1]))
+      idx[--d] = 0;
+    if (d == 0)
+      break;
+  }
+  if ((p.var->type == "Byte") && (n % 4))
+    reply.write(string(4 - n%4, '\0'));
+}
+
+
+//---------------------------------------------------------------
+// 5. RECORD AND REPLAY
+//---------------------------------------------------------------
+// An archive is a directory of response bodies (<n>.body, as decoded
+// by the client) and an index with one tab-separated line per exchange:
+//   n  status  ttfb  total  content-type  content-description  target
+// where target is the request path and query as sent.
+
+struct Exchange {
+  int    n, status;
+  double ttfb, total;     // s to the first body byte and to the end
+  string type, description, target;
+};
+
+class Archive
+{
+ public:
+  Archive() : m_count(0) {}
+
+  // Record into 'dir', after any exchanges already there
+  bool create(const string &dir)
+  {
+    mkdir(dir.c_str(), 0755);
+    load(dir);
+    ofstream index((dir + "/index").c_str(), ios::app);
+    return index.good();
+  }
+
+  // Read the index of 'dir'; false if it has no exchanges
+  bool load(const string &dir)
+  {
+    m_dir = dir;
+    ifstream index((dir + "/index").c_str());
+    string line;
+    while (getline(index, line)){
+      vector<string> f(1);
+      for (size_t i=0; i<line.size(); i++)
+        if (line[i] == '\t')
+          f.push_back("");
+        else
+          f.back() += line[i];
+      if (f.size() != 7)
+        continue;
+      Exchange e;
+      e.n = atoi(f[0].c_str());
+      e.status = atoi(f[1].c_str());
+      e.ttfb = atof(f[2].c_str());
+      e.total = atof(f[3].c_str());
+      e.type = f[4];
+      e.description = f[5];
+      e.target = f[6];
+      m_recs[e.target].push_back(e);
+      m_count = max(m_count, e.n + 1);
+    }
+    return m_count > 0;
+  }
+
+  void add(Exchange e, const string &body)
+  {
+    lock_guard<mutex> lock(m_mutex);
+    e.n = m_count++;
+    ofstream out(bodyPath(e.n).c_str(), ios::binary);
+    out.write(body.data(), body.size());
+    ofstream index((m_dir + "/index").c_str(), ios::app);
+    index << e.n << '\t' << e.status << '\t' << e.ttfb << '\t' << e.total
+          << '\t' << e.type << '\t' << e.description << '\t' << e.target
+          << '\n';
+    m_recs[e.target].push_back(e);
+  }
+
+  // Recorded exchange for 'target': repeated requests get the
+  // recordings in order, then the last one again
+  bool next(const string &target, Exchange &e, string &body)
+  {
+    {
+      lock_guard<mutex> lock(m_mutex);
+      map<string,vector<Exchange> >::iterator r = m_recs.find(target);
+      if (r == m_recs.end())
+        return false;
+      size_t &i = m_next[target];
+      e = r->second[min(i, r->second.size()-1)];
+      i++;
+    }
+    ifstream in(bodyPath(e.n).c_str(), ios::binary);
+    body.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    return true;
+  }
+
+  int size() const { return m_count; }
+
+ private:
+  string bodyPath(int n) const
+  {
+    ostringstream s;
+    s << m_dir << "/" << n << ".body";
+    return s.str();
+  }
+
+  string                          m_dir;
+  map<string,vector<Exchange> >   m_recs;
+  map<string,size_t>              m_next;
+  int                             m_count;
+  mutex                           m_mutex;
+};
+
+static double since(chrono::steady_clock::time_point t0)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+// State of one request passed on to the real server
+struct Relay {
+  Reply   *reply;
+  Exchange ex;
+  string   body;
+  chrono::steady_clock::time_point t0;
+  bool     begun, dropped;
+};
+
+static size_t relayHeader(char *ptr, size_t size, size_t nmemb, void *user)
+{
+  Relay &r = *(Relay*)user;
+  string line(ptr, size*nmemb);
+  line = line.substr(0, line.find_last_not_of("\r\n") + 1);
+  size_t colon = line.find(':');
+  if (line.compare(0, 5, "HTTP/") == 0){
+    r.ex.status = atoi(line.substr(line.find(' ') + 1).c_str());
+    r.ex.type = r.ex.description = ""; // new response (redirects)
+  }
+  else if (colon != string::npos){
+    string key = line.substr(0, colon);
+    string value = line.substr(line.find_first_not_of(' ', colon+1));
+    transform(key.begin(), key.end(), key.begin(), ::tolower);
+    if (key == "content-type")
+      r.ex.type = value;
+    else if (key == "content-description")
+      r.ex.description = value;
+  }
+  return size*nmemb;
+}
+
+static size_t relayBody(char *ptr, size_t size, size_t nmemb, void *user)
+{
+  Relay &r = *(Relay*)user;
+  size_t n = size*nmemb;
+  try{
+    if (!r.begun){
+      r.ex.ttfb = since(r.t0);
+      r.reply->begin(r.ex.status, r.ex.type, r.ex.description);
+      r.begun = true;
+    }
+    r.reply->write(ptr, n);
+  }
+  catch(Disconnect &){
+    r.dropped = true;
+    return 0;
+  }
+  r.body.append(ptr, n);
+  return n;
+}
+
+// Pass 'target' on to 'upstream', stream the response back and record
+// it; returns the HTTP status
+static int relay(const string &upstream, Archive &archive, int fd,
+                 const string &target, Reply &reply)
+{
+  Relay r;
+  r.reply = &reply;
+  r.ex.status = 0;
+  r.ex.ttfb = 0;
+  r.ex.target = target;
+  r.t0 = chrono::steady_clock::now();
+  r.begun = r.dropped = false;
+
+  CURL *curl = curl_easy_init();
+  if (!curl)
+    throw runtime_error("curl_easy_init failed");
+  dapConnection(curl);
+  string url = upstream + target;
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, relayHeader);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &r);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, relayBody);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &r);
+  CURLcode res = curl_easy_perform(curl);
+  curl_easy_cleanup(curl);
+
+  if (r.dropped || ((res != CURLE_OK) && r.begun))
+    throw Disconnect(); // cut off mid-body: not recorded
+  if (res != CURLE_OK){
+    errorReply(fd, 502, string("Upstream: ") + curl_easy_strerror(res));
+    return 502;
+  }
+  if (!r.begun){
+    r.ex.ttfb = since(r.t0);
+    reply.begin(r.ex.status, r.ex.type, r.ex.description);
+  }
+  // on disk before the client sees the end, so it may stop the recorder
+  r.ex.total = since(r.t0);
+  archive.add(r.ex, r.body);
+  reply.end();
+  return r.ex.status;
+}
+
+// Serve the recorded response to 'target'; 'timed' waits the recorded
+// time to first byte and paces the body over the recorded duration
+static int replay(Archive &archive, bool timed, int fd, const string &target,
+                  Emulation emu, bool gzip, long drop, double &bytes)
+{
+  Exchange e;
+  string body;
+  if (!archive.next(target, e, body)){
+    errorReply(fd, 404, "Not in archive: " + target);
+    return 404;
+  }
+  if (timed){
+    this_thread::sleep_for(chrono::microseconds((long long)(1e6*e.ttfb)));
+    double rest = e.total - e.ttfb;
+    // the pacer counts wire bytes, compressed when gzip is on
+    emu.bandwidth = (rest > 0) ? Reply::encodedSize(body, gzip)/rest : 0;
+  }
+  Reply reply(fd, emu, gzip, drop);
+  reply.begin(e.status, e.type, e.description);
+  reply.write(body);
+  reply.end();
+  bytes = reply.sent();
+  return e.status;
+}
+
+
+//---------------------------------------------------------------
+// 6. CONNECTIONS
+//---------------------------------------------------------------
+struct Server {
+  Dataset  *ds;
+  Emulation emu;
+  bool      quiet;
+  string    upstream;  // record: real server
+  bool      replay;    // replay the archive
+  bool      timed;     // replay with the recorded timing
+  Archive   archive;
+  mutex     log;
+  unsigned  seed;      // of the injected faults
+  map<string,unsigned> asked; // times each target was requested
+  mutex     faults;
+};
+
+struct Request {
+  string method, path, query;
+  bool   keepalive, gzip;
+};
+
+static bool endsWith(const string &s, const string &suffix)
+{
+  return (s.size() >= suffix.size()) &&
+         (s.compare(s.size()-suffix.size(), suffix.size(), suffix) == 0);
+}
+
+// Read the next request head; false when the client is done
+static bool readRequest(int fd, string &in, Request &req)
+{
+  size_t end;
+  while ((end = in.find("\r\n\r\n")) == string::npos){
+    char b[4096];
+    ssize_t r = recv(fd, b, sizeof(b), 0);
+    if ((r <= 0) || (in.size() > 65536))
+      return false;
+    in.append(b, r);
+  }
+  istringstream head(in.substr(0, end));
+  in.erase(0, end+4);
+
+  string target, version, line;
+  head >> req.method >> target >> version;
+  getline(head, line);
+  size_t q = target.find('?');
+  req.path = target.substr(0, q);
+  req.query = (q == string::npos) ? "" : target.substr(q+1);
+  req.keepalive = (version == "HTTP/1.1");
+  req.gzip = false;
+  while (getline(head, line)){
+    transform(line.begin(), line.end(), line.begin(), ::tolower);
+    if (line.find("connection:") == 0)
+      req.keepalive = (line.find("close") == string::npos) &&
+        ((version == "HTTP/1.1") || (line.find("keep-alive") != string::npos));
+    else if (line.find("accept-encoding:") == 0)
+      req.gzip = (line.find("gzip") != string::npos);
+  }
+  return true;
+}
+
+// Generator of the faults injected into the n-th request of 'target':
+// the same requests get the same faults whatever the order in which
+// connections arrive, and a retry gets a fresh draw
+static mt19937 faultSource(Server &srv, const string &target)
+{
+  unsigned n;
+  {
+    lock_guard<mutex> lock(srv.faults);
+    n = srv.asked[target]++;
+  }
+  uint32_t h = 2166136261u;
+  for (size_t i=0; i<target.size(); i++){
+    h ^= (unsigned char)target[i];
+    h *= 16777619u;
+  }
+  seed_seq seq = {srv.seed, h, n};
+  return mt19937(seq);
+}
+
+// Answer one request; returns the HTTP status
+static int respond(Server &srv, int fd, const Request &req, double &bytes)
+{
+  string target = req.path + (req.query.empty() ? "" : "?" + req.query);
+  mt19937 rng = faultSource(srv, target);
+  uniform_real_distribution<double> u(0, 1);
+  if (srv.emu.latency > 0)
+    this_thread::sleep_for(chrono::microseconds(
+      (long long)(1e6*srv.emu.latency)));
+  if (req.method != "GET"){
+    errorReply(fd, 405, "Only GET is supported");
+    return 405;
+  }
+  if (u(rng) < srv.emu.error_rate){
+    errorReply(fd, 503, "Injected error (dap_server --error-rate)");
+    return 503;
+  }
+  long drop = -1;
+  if (u(rng) < srv.emu.drop_rate)
+    drop = (long)(u(rng)*65536);
+  bool gzip = srv.emu.gzip && req.gzip;
+
+  if (srv.replay)
+    return replay(srv.archive, srv.timed, fd, target, srv.emu, gzip, drop,
+                  bytes);
+  if (!srv.upstream.empty()){
+    Reply reply(fd, srv.emu, gzip, drop);
+    int status = relay(srv.upstream, srv.archive, fd, target, reply);
+    bytes = reply.sent();
+    return status;
+  }
+
+  string kind;
+  if (endsWith(req.path, ".dds"))       kind = "dds";
+  else if (endsWith(req.path, ".das"))  kind = "das";
+  else if (endsWith(req.path, ".dods")) kind = "dods";
+  else{
+    errorReply(fd, 404, "Unknown request, expected .dds, .das or .dods");
+    return 404;
+  }
+  vector<Projection> proj;
+  string error;
+  if ((kind != "das") && !parseConstraint(*srv.ds, req.query, proj, error)){
+    errorReply(fd, 400, error);
+    return 400;
+  }
+
+  Reply reply(fd, srv.emu, gzip, drop);
+  if (kind == "das"){
+    reply.begin(200, "text/plain", "dods-das");
+    reply.write(dasText(*srv.ds));
+  }
+  else if (kind == "dds"){
+    reply.begin(200, "text/plain", "dods-dds");
+    reply.write(ddsText(*srv.ds, proj));
+  }
+  else{
+    reply.begin(200, "application/octet-stream", "dods-data");
+    reply.write(ddsText(*srv.ds, proj) + "Data:\n");
+    for (size_t p=0; p<proj.size(); p++)
+      writeArray(*srv.ds, proj[p], reply);
+  }
+  reply.end();
+  bytes = reply.sent();
+  return 200;
+}
+
+static void serve(Server *srv, int fd)
+{
+  string in;
+  Request req;
+  try{
+    while (readRequest(fd, in, req)){
+      chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+      double bytes = 0;
+      int status = respond(*srv, fd, req, bytes);
+      if (!srv->quiet){
+        double secs = chrono::duration<double>(
+          chrono::steady_clock::now() - t0).count();
+        lock_guard<mutex> lock(srv->log);
+        cout << req.method << " " << req.path
+             << (req.query.empty() ? "" : "?") << urlDecode(req.query)
+             << " -> " << status << ", " << bytes << " B, " << secs << " s"
+             << endl;
+      }
+      if (!req.keepalive)
+        break;
+    }
+  }
+  catch(Disconnect &){
+  }
+  catch(exception &e){
+    lock_guard<mutex> lock(srv->log);
+    cout << "(!) " << e.what() << endl;
+  }
+  close(fd);
+}
+
+
+//---------------------------------------------------------------
+// 7. MAIN
+//---------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  //---------------------------------------------------------------
+  // 7.1: Parse command line
+  int port = 8080;
+  string file = "";
+  string grid = "24,40,4251,4500";   // synthetic [time,depth,lat,lon]
+  Emulation emu = {0, 0, 0, 0, false};
+  unsigned seed = 1;
+  bool quiet = false;
+  string record = "", replay = "";
+  string upstream = "https://tds.hycom.org";
+  bool timed = true;
+  for (int i=1; i<argc; i++){
+    string argi = argv[i];
+    if(argi.find("--port=") == 0)
+      port = atoi(argi.substr(7).c_str());
+    else if(argi.find("--file=") == 0)
+      file = argi.substr(7);
+    else if(argi.find("--synthetic=") == 0)
+      grid = argi.substr(12);
+    else if(argi.find("--synthetic") == 0)
+      file = "";
+    else if(argi.find("--latency=") == 0)
+      emu.latency = atof(argi.substr(10).c_str())/1000;
+    else if(argi.find("--bandwidth=") == 0)
+      emu.bandwidth = atof(argi.substr(12).c_str())*1048576;
+    else if(argi.find("--error-rate=") == 0)
+      emu.error_rate = atof(argi.substr(13).c_str());
+    else if(argi.find("--drop-rate=") == 0)
+      emu.drop_rate = atof(argi.substr(12).c_str());
+    else if(argi.find("--gzip=true") == 0)
+      emu.gzip = true;
+    else if(argi.find("--seed=") == 0)
+      seed = atoi(argi.substr(7).c_str());
+    else if(argi.find("--quiet") == 0)
+      quiet = true;
+    else if(argi.find("--record=") == 0)
+      record = argi.substr(9);
+    else if(argi.find("--upstream=") == 0)
+      upstream = argi.substr(11);
+    else if(argi.find("--replay=") == 0)
+      replay = argi.substr(9);
+    else if(argi.find("--timing=") == 0){
+      string input = argi.substr(9);
+      if ((input != "original") && (input != "fast")){
+        cout << "(!) UNKNOWN TIMING: " << input << endl;
+        return NC_ERR;
+      }
+      timed = (input == "original");
+    }
+    else if((argi.find("-h")==0)||(argi.find("--help")==0)){
+      cout <<"\n  SUMMARY: Local DAP2 server standing in for tds.hycom.org,\n"
+           <<"           for offline benchmarks of the remote read path.";
+      cout <<"\n\n  USAGE: " << argv[0] << " [command line switches]\n"
+           <<"  --synthetic[=T,Z,Y,X]  : serve synthetic HYCOM fields (default)\n"
+           <<"  --file=[PATH]          : serve the variables of a NetCDF file\n"
+           <<"  --port=[INT]           : listen on 127.0.0.1:port (8080)\n"
+           <<"  --latency=[FLOAT]      : delay before each response [ms]\n"
+           <<"  --bandwidth=[FLOAT]    : cap per connection [MB/s]\n"
+           <<"  --error-rate=[FLOAT]   : fraction of requests failing (503)\n"
+           <<"  --drop-rate=[FLOAT]    : fraction of responses cut off\n"
+           <<"  --gzip=true            : gzip responses when asked to\n"
+           <<"  --seed=[INT]           : seed of the injected faults\n"
+           <<"  --quiet                : do not log requests\n"
+           <<"  --record=[DIR]         : proxy to --upstream, record into DIR\n"
+           <<"  --upstream=[URL]       : server to record (https://tds.hycom.org)\n"
+           <<"  --replay=[DIR]         : serve the exchanges recorded in DIR\n"
+           <<"  --timing=[original|fast] : replay with recorded timing or at once\n"
+           << endl;
+      return(1);
+    }
+  }
+
+  try{
+    //---------------------------------------------------------------
+    // 7.2: Load dataset
+    Server srv;
+    unique_ptr<Dataset> ds;
+    if (!record.empty() && !replay.empty()){
+      cout << "(!) --record AND --replay ARE EXCLUSIVE" << endl;
+      return NC_ERR;
+    }
+    if (!record.empty()){
+      if (!srv.archive.create(record)){
+        cout << "(!) CANNOT WRITE ARCHIVE: " << record << endl;
+        return NC_ERR;
+      }
+    }
+    else if (!replay.empty()){
+      if (!srv.archive.load(replay)){
+        cout << "(!) NO EXCHANGES RECORDED IN: " << replay << endl;
+        return NC_ERR;
+      }
+    }
+    else if (!file.empty())
+      ds.reset(new FileDataset(file));
+    else{
+      size_t nt, nz, ny, nx;
+      if ((sscanf(grid.c_str(), "%zu,%zu,%zu,%zu", &nt, &nz, &ny, &nx) != 4)
+          || !nt || !nz || !ny || !nx){
+        cout << "(!) BAD SYNTHETIC GRID: " << grid << endl;
+        return NC_ERR;
+      }
+      ds.reset(new SyntheticDataset(nt, nz, ny, nx));
+    }
+
+    //---------------------------------------------------------------
+    // 7.3: Listen on localhost
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if ((sock < 0) || (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        || (listen(sock, 64) != 0)){
+      cout << "(!) CANNOT LISTEN ON PORT " << port << endl;
+      return NC_ERR;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    srv.ds = ds.get();
+    srv.emu = emu;
+    srv.quiet = quiet;
+    srv.upstream = record.empty() ? "" : upstream;
+    srv.replay = !replay.empty();
+    srv.timed = timed;
+    srv.seed = seed;
+    if (!record.empty()){
+      cout << "RECORDING: http://127.0.0.1:" << port << " -> " << upstream
+           << endl;
+      cout << "  into " << record;
+    }
+    else if (!replay.empty()){
+      cout << "REPLAYING: http://127.0.0.1:" << port << endl;
+      cout << "  " << srv.archive.size() << " exchanges in " << replay
+           << (timed ? ", original timing" : ", fast");
+    }
+    else{
+      cout << "SERVING: http://127.0.0.1:" << port << "/" << ds->name() << endl;
+      cout << "  " << ds->vars().size() << " variables";
+    }
+    if (emu.latency > 0)
+      cout << ", latency " << emu.latency*1000 << " ms";
+    if (emu.bandwidth > 0)
+      cout << ", " << emu.bandwidth/1048576 << " MB/s per connection";
+    if (emu.error_rate > 0)
+      cout << ", error rate " << emu.error_rate;
+    if (emu.drop_rate > 0)
+      cout << ", drop rate " << emu.drop_rate;
+    if (emu.gzip)
+      cout << ", gzip";
+    cout << endl;
+
+    //---------------------------------------------------------------
+    // 7.4: One thread per connection
+    while (true){
+      int fd = accept(sock, NULL, NULL);
+      if (fd < 0)
+        continue;
+      thread(serve, &srv, fd).detach();
+    }
+  }
+  catch(NcException &e){
+    cout << "(!) " << e.what() << endl;
+    return NC_ERR;
+  }
+  return 0;
+}
@@ -0,0 +1,199 @@
+/************************************************************/
+/*    FILE: hycom_aggregate.h                               */
+/************************************************************/
+
+// Time index over a directory of per-day HYCOM files.
+//
+// A local mirror of e.g. expt_53.X/data/2013 holds one NetCDF file per
+// day.  DirectoryIndex lists the *.nc files once and records the time
+// axis and grid size of each, so the request window can be mapped to
+// (file, record) pairs, and the files checked against the grid, without
+// opening every file.  The index is kept in the metadata
+// cache directory; a file is only re-opened when its size or mtime
+// changed since the index was written.
+
+#ifndef HYCOM_AGGREGATE_H
+#define HYCOM_AGGREGATE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <netcdf>
+
+struct AggFile
+{
+  std::string name;        // file name within the directory
+  long size, mtime;
+  size_t grid[3];          // depth, lat, lon sizes (0 = no such dim)
+  std::vector<float> time; // hours since 2000-01-01 00:00:00
+};
+
+inline bool earlierFile(const AggFile &a, const AggFile &b)
+{
+  if (a.time.empty() || b.time.empty())
+    return b.time.empty() && !a.time.empty();
+  return a.time[0] < b.time[0];
+}
+
+class DirectoryIndex
+{
+ public:
+  DirectoryIndex() : m_opened(0) {}
+
+  // Index the *.nc files of 'dir'; 'cache_dir' holds the index file
+  // ("" = rebuild every run).  false if no file has a time axis.
+  bool scan(const std::string &dir, const std::string &cache_dir)
+  {
+    m_dir = dir;
+    std::map<std::string,AggFile> cached;
+    std::string path = cache_dir.empty() ? "" : indexPath(cache_dir, dir);
+    if (!path.empty())
+      load(path, cached);
+
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+      return false;
+    struct dirent *e;
+    std::vector<std::string> names;
+    while ((e = readdir(d))){
+      std::string name = e->d_name;
+      if ((name.size() > 3) && (name.rfind(".nc") == name.size()-3))
+        names.push_back(name);
+    }
+    closedir(d);
+
+    m_files.clear();
+    bool changed = false;
+    for (size_t i=0; i<names.size(); i++){
+      struct stat st;
+      if (stat(file(names[i]).c_str(), &st) != 0)
+        continue;
+      std::map<std::string,AggFile>::iterator c = cached.find(names[i]);
+      if ((c != cached.end()) && (c->second.size == (long)st.st_size) &&
+          (c->second.mtime == (long)st.st_mtime)){
+        m_files.push_back(c->second);
+        continue;
+      }
+      AggFile f;
+      f.name = names[i];
+      f.size = st.st_size;
+      f.mtime = st.st_mtime;
+      std::fill(f.grid, f.grid+3, 0);
+      try{
+        netCDF::NcFile nc(file(f.name), netCDF::NcFile::read);
+        const char *dims[3] = {"depth", "lat", "lon"};
+        for (int d=0; d<3; d++){
+          netCDF::NcDim dim = nc.getDim(dims[d]);
+          if (!dim.isNull())
+            f.grid[d] = dim.getSize();
+        }
+        netCDF::NcVar t = nc.getVar("time");
+        if (!t.isNull()){
+          f.time.resize(t.getDim(0).getSize());
+          if (!f.time.empty())
+            t.getVar(&f.time[0]);
+        }
+      }
+      catch(std::exception &){
+        // not a readable NetCDF file: kept without records
+      }
+      m_opened++;
+      m_files.push_back(f);
+      changed = true;
+    }
+    changed = changed || (cached.size() != m_files.size());
+    std::stable_sort(m_files.begin(), m_files.end(), earlierFile);
+    if (changed && !path.empty())
+      save(cache_dir, path);
+
+    // files without records sort last
+    while (!m_files.empty() && m_files.back().time.empty())
+      m_files.pop_back();
+    return !m_files.empty();
+  }
+
+  const std::vector<AggFile>& files() const { return m_files; }
+
+  // Full path of file 'name'
+  std::string file(const std::string &name) const
+  {
+    return m_dir + "/" + name;
+  }
+
+  // Files opened by the last scan (the rest came from the index)
+  int opened() const { return m_opened; }
+
+ private:
+  static std::string indexPath(const std::string &cache_dir,
+                               const std::string &dir)
+  {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i=0; i<dir.size(); i++){
+      h ^= (unsigned char)dir[i];
+      h *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.index", (unsigned long long)h);
+    return cache_dir + "/" + name;
+  }
+
+  // Format: "HYCOM_INDEX 2", then one line per file
+  //   size mtime nz ny nx n t0 t1 ... t(n-1) name
+  // with the name last, so it may hold spaces
+  void load(const std::string &path, std::map<std::string,AggFile> &files)
+  {
+    std::ifstream in(path.c_str());
+    std::string line;
+    if (!getline(in, line) || (line != "HYCOM_INDEX 2"))
+      return;
+    while (getline(in, line)){
+      std::istringstream rec(line);
+      AggFile f;
+      size_t n;
+      if (!(rec >> f.size >> f.mtime >> f.grid[0] >> f.grid[1] >> f.grid[2]
+            >> n))
+        continue;
+      f.time.resize(n);
+      for (size_t i=0; i<n; i++)
+        rec >> f.time[i];
+      if (rec.get() != ' ')
+        continue; // cut short
+      getline(rec, f.name);
+      if (!f.name.empty())
+        files[f.name] = f;
+    }
+  }
+
+  void save(const std::string &cache_dir, const std::string &path) const
+  {
+    mkdir(cache_dir.c_str(), 0755);
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp.c_str());
+    out.precision(9);
+    out << "HYCOM_INDEX 2\n";
+    for (size_t i=0; i<m_files.size(); i++){
+      const AggFile &f = m_files[i];
+      out << f.size << " " << f.mtime << " " << f.grid[0] << " "
+          << f.grid[1] << " " << f.grid[2] << " " << f.time.size();
+      for (size_t t=0; t<f.time.size(); t++)
+        out << " " << f.time[t];
+      out << " " << f.name << "\n";
+    }
+    out.close();
+    if (out)
+      rename(tmp.c_str(), path.c_str());
+  }
+
+  std::string          m_dir;
+  std::vector<AggFile> m_files;
+  int                  m_opened;
+};
+
+#endif
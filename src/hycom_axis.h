@@ -0,0 +1,86 @@
+/************************************************************/
+/*    FILE: hycom_axis.h                                    */
+/************************************************************/
+
+// Monotonic coordinate axis with on-demand element reads.
+//
+// The time axis of an aggregated experiment is long, but step 4.1.4
+// only needs the two bracketing indices and the selected range.
+// LazyAxis wraps the caller's array and reads single elements from the
+// remote variable the first time they are touched, so a binary search
+// transfers about log2(n) values instead of n.
+
+#ifndef HYCOM_AXIS_H
+#define HYCOM_AXIS_H
+
+#include <vector>
+#include <cstddef>
+#include <netcdf>
+
+class LazyAxis
+{
+ public:
+  // values: caller's array of n entries, filled in as they are read
+  LazyAxis(const netCDF::NcVar &var, float *values, size_t n)
+    : m_var(var), m_values(values), m_known(n, false), m_reads(0) {}
+
+  // The whole array is already filled (e.g. read in one go)
+  void setKnown() { m_known.assign(m_known.size(), true); }
+
+  float at(size_t i)
+  {
+    if (!m_known[i]){
+      std::vector<size_t> start(1, i), count(1, 1);
+      m_var.getVar(start, count, &m_values[i]);
+      m_known[i] = true;
+      m_reads++;
+    }
+    return m_values[i];
+  }
+
+  // First index with value >= v (size() if none)
+  size_t lowerBound(float v) { return bound(v, false); }
+
+  // First index with value > v (size() if none)
+  size_t upperBound(float v) { return bound(v, true); }
+
+  // Make [lo, hi] available with a single request
+  void fill(size_t lo, size_t hi)
+  {
+    size_t i = lo;
+    while ((i <= hi) && m_known[i])
+      i++;
+    if (i > hi)
+      return;
+    std::vector<size_t> start(1, lo), count(1, hi-lo+1);
+    m_var.getVar(start, count, &m_values[lo]);
+    for (i=lo; i<=hi; i++)
+      m_known[i] = true;
+    m_reads++;
+  }
+
+  size_t size()  const { return m_known.size(); }
+  int    reads() const { return m_reads; }
+
+ private:
+  size_t bound(float v, bool strict)
+  {
+    size_t lo = 0, hi = m_known.size();
+    while (lo < hi){
+      size_t mid = lo + (hi-lo)/2;
+      float x = at(mid);
+      if (strict ? (x <= v) : (x < v))
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  netCDF::NcVar     m_var;
+  float            *m_values;
+  std::vector<bool> m_known;
+  int               m_reads;
+};
+
+#endif
@@ -0,0 +1,100 @@
+/************************************************************/
+/*    FILE: hycom_buffers.h                                 */
+/************************************************************/
+
+// Aligned heap buffers for grid-sized arrays.
+//
+// The axes, the output coordinates and the packed records written in
+// step 6 used to be variable-length arrays on the stack, which crashes
+// once a region outgrows the stack (8 MB by default), and the packed
+// record arrays were declared anew on every record.  AlignedBuffer
+// holds such an array on the heap, aligned to BUFFER_ALIGN bytes (a
+// cache line, and the widest SIMD load), and keeps its allocation when
+// resized smaller, so one buffer sized from the planned hyperslab
+// serves every record and variable of a run.  It converts to T*, so
+// code written for the arrays reads it unchanged.
+//
+// AlignedAllocator gives std::vector the same alignment (the batch
+// buffers of the read pipeline).
+
+#ifndef HYCOM_BUFFERS_H
+#define HYCOM_BUFFERS_H
+
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+
+static const size_t BUFFER_ALIGN = 64;
+
+inline void* alignedAlloc(size_t bytes)
+{
+  void *p = NULL;
+  if (posix_memalign(&p, BUFFER_ALIGN, bytes ? bytes : BUFFER_ALIGN) != 0)
+    throw std::bad_alloc();
+  return p;
+}
+
+template <class T>
+class AlignedBuffer
+{
+ public:
+  AlignedBuffer() : m_data(NULL), m_size(0), m_capacity(0) {}
+  explicit AlignedBuffer(size_t n) : m_data(NULL), m_size(0), m_capacity(0)
+  {
+    resize(n);
+  }
+  ~AlignedBuffer(){ free(m_data); }
+
+  // n elements, contents undefined; reallocates only to grow
+  void resize(size_t n)
+  {
+    if (n > m_capacity){
+      T *data = (T*)alignedAlloc(n*sizeof(T));
+      free(m_data);
+      m_data = data;
+      m_capacity = n;
+    }
+    m_size = n;
+  }
+
+  T*       data()       { return m_data; }
+  const T* data() const { return m_data; }
+  size_t   size() const { return m_size; }
+  operator T*()             { return m_data; }
+  operator const T*() const { return m_data; }
+
+ private:
+  AlignedBuffer(const AlignedBuffer&);            // not copyable
+  AlignedBuffer& operator=(const AlignedBuffer&);
+
+  T     *m_data;
+  size_t m_size, m_capacity;
+};
+
+template <class T>
+struct AlignedAllocator
+{
+  typedef T value_type;
+
+  AlignedAllocator() {}
+  template <class U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+  T* allocate(size_t n) { return (T*)alignedAlloc(n*sizeof(T)); }
+  void deallocate(T *p, size_t) { free(p); }
+
+  template <class U> struct rebind { typedef AlignedAllocator<U> other; };
+};
+
+template <class T, class U>
+inline bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+  return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+  return false;
+}
+
+#endif
@@ -0,0 +1,501 @@
+/************************************************************/
+/*    FILE: hycom_cache.h                                   */
+/************************************************************/
+
+// Persistent on-disk cache of fetched HYCOM tiles.
+//
+// Every fetched block is stored per (dataset URL, variable, time index)
+// together with its index range [depth][lat][lon], as raw packed
+// shorts.  A later request is first filled from all overlapping cached
+// blocks; only the part of the box no block covers is planned for
+// fetching.  Growing a bounding box therefore only downloads the new
+// margin.
+//
+// Strided reads are cached separately per spatial stride and phase;
+// their boxes are in points of the decimated grid.  A box across the
+// longitude seam is split there and its east part stored at column
+// indices modulo the lon size (under the stride phase it has after
+// wrapping), so the same columns requested without a wrap hit it.
+//
+// Layout:  DIR/<hash of url,var,time>/key         (the full key text)
+//          DIR/<hash of url,var,time>/z0-z1_y0-y1_x0-x1.tile
+// Reading a tile bumps its mtime; trim() deletes the least recently
+// used tiles until the cache is under its size cap.
+
+#ifndef HYCOM_CACHE_H
+#define HYCOM_CACHE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "hycom_tiles.h"
+
+// Index box [lo,hi) over [depth][lat][lon]
+struct Box
+{
+  size_t lo[3], hi[3];
+
+  size_t size() const
+  {
+    size_t n = 1;
+    for (int d=0; d<3; d++)
+      n *= (hi[d] > lo[d]) ? hi[d]-lo[d] : 0;
+    return n;
+  }
+  bool operator==(const Box &b) const
+  {
+    for (int d=0; d<3; d++)
+      if ((lo[d] != b.lo[d]) || (hi[d] != b.hi[d]))
+        return false;
+    return true;
+  }
+};
+
+inline Box intersect(const Box &a, const Box &b)
+{
+  Box c;
+  for (int d=0; d<3; d++){
+    c.lo[d] = std::max(a.lo[d], b.lo[d]);
+    c.hi[d] = std::max(c.lo[d], std::min(a.hi[d], b.hi[d]));
+  }
+  return c;
+}
+
+// Append the (up to 6) boxes making up a \ b
+inline void subtract(const Box &a, const Box &b, std::vector<Box> &out)
+{
+  Box c = intersect(a, b);
+  if (c.size() == 0){
+    out.push_back(a);
+    return;
+  }
+  Box rest = a;
+  for (int d=0; d<3; d++){
+    if (rest.lo[d] < c.lo[d]){
+      Box s = rest;
+      s.hi[d] = c.lo[d];
+      out.push_back(s);
+    }
+    if (c.hi[d] < rest.hi[d]){
+      Box s = rest;
+      s.lo[d] = c.hi[d];
+      out.push_back(s);
+    }
+    rest.lo[d] = c.lo[d];
+    rest.hi[d] = c.hi[d];
+  }
+}
+
+// Copy 'region' between two buffers laid out as boxes 'from' and 'to'
+inline void copyBox(const short *src, const Box &from,
+                    short *dst, const Box &to, const Box &region)
+{
+  size_t nx = region.hi[2] - region.lo[2];
+  for (size_t i=region.lo[0]; i<region.hi[0]; i++)
+    for (size_t j=region.lo[1]; j<region.hi[1]; j++){
+      size_t s = ((i-from.lo[0])*(from.hi[1]-from.lo[1]) + j-from.lo[1])
+        *(from.hi[2]-from.lo[2]) + region.lo[2]-from.lo[2];
+      size_t t = ((i-to.lo[0])*(to.hi[1]-to.lo[1]) + j-to.lo[1])
+        *(to.hi[2]-to.lo[2]) + region.lo[2]-to.lo[2];
+      memcpy(dst+t, src+s, nx*sizeof(short));
+    }
+}
+
+class TileCache
+{
+ public:
+  TileCache(const std::string &dir, double max_bytes)
+    : m_dir(dir), m_max_bytes(max_bytes), m_hit_bytes(0), m_miss_bytes(0),
+      m_evicted(0)
+  {
+    mkdir(m_dir.c_str(), 0755);
+  }
+
+  // Fill batch cubes out[v] (extents 'count', origin 'start', steps
+  // 'stride') from the cache and return the jobs for whatever is still
+  // missing.  wrap: lon size when the box may cross the seam (unwrapped
+  // indices, as for planJobs), else 0.
+  std::vector<FetchJob> planBatch(const std::string &url,
+                                  const std::vector<std::string> &names,
+                                  const std::vector<size_t> &start,
+                                  const std::vector<size_t> &count,
+                                  const std::vector<size_t> &stride,
+                                  const std::vector<short*> &out,
+                                  bool combined, double max_bytes,
+                                  int min_jobs, size_t wrap = 0)
+  {
+    Box box = boxOf(start, count, stride);
+    std::vector<Piece> pieces = piecesOf(start, count, stride, wrap);
+    size_t slab = box.size();
+    int nvars = names.size();
+
+    // missing[t][v]: boxes of record t, variable v still to fetch
+    std::vector<std::vector<std::vector<Box> > > missing(count[0]);
+    for (size_t t=0; t<count[0]; t++)
+      for (int v=0; v<nvars; v++){
+        std::vector<Box> holes;
+        for (size_t p=0; p<pieces.size(); p++)
+          lookup(url, names[v], start[0]+t*stride[0], pieces[p], box,
+                 out[v] + t*slab, holes);
+        missing[t].push_back(holes);
+      }
+
+    // Consecutive records with the same holes share one time range
+    std::vector<FetchJob> jobs;
+    size_t t0 = 0;
+    for (size_t t=1; t<=count[0]; t++){
+      if ((t < count[0]) && (missing[t] == missing[t0]))
+        continue;
+      bool same = true;
+      for (int v=1; v<nvars; v++)
+        same = same && (missing[t0][v] == missing[t0][0]);
+
+      bool comb = combined && same;
+      for (int v=0; v<(comb ? 1 : nvars); v++){
+        const std::vector<Box> &holes = missing[t0][v];
+        for (size_t h=0; h<holes.size(); h++){
+          std::vector<size_t> hs(4), hc(4);
+          hs[0] = start[0] + t0*stride[0];
+          hc[0] = t - t0;
+          for (int d=0; d<3; d++){
+            hs[d+1] = start[d+1] + (holes[h].lo[d] - box.lo[d])*stride[d+1];
+            hc[d+1] = holes[h].hi[d] - holes[h].lo[d];
+          }
+          std::vector<FetchJob> part = planJobs(comb ? nvars : 1, comb,
+                                                hs, hc, stride,
+                                                max_bytes, min_jobs, wrap);
+          for (size_t j=0; j<part.size(); j++){
+            if (!comb)
+              part[j].var = v;
+            part[j].dst[0] += t0;
+            for (int d=1; d<4; d++)
+              part[j].dst[d] += holes[h].lo[d-1] - box.lo[d-1];
+            jobs.push_back(part[j]);
+          }
+        }
+      }
+      t0 = t;
+    }
+    return jobs;
+  }
+
+  // Store the blocks fetched by 'jobs' from the filled batch cubes
+  void storeBatch(const std::string &url,
+                  const std::vector<std::string> &names,
+                  const std::vector<FetchJob> &jobs,
+                  const std::vector<size_t> &start,
+                  const std::vector<size_t> &count,
+                  const std::vector<size_t> &stride,
+                  const std::vector<short*> &out,
+                  size_t wrap = 0)
+  {
+    Box box = boxOf(start, count, stride);
+    std::vector<Piece> pieces = piecesOf(start, count, stride, wrap);
+    size_t slab = box.size();
+    std::vector<short> block;
+    for (size_t j=0; j<jobs.size(); j++){
+      Box tile;
+      for (int d=0; d<3; d++){
+        tile.lo[d] = box.lo[d] + jobs[j].dst[d+1];
+        tile.hi[d] = tile.lo[d] + jobs[j].count[d+1];
+      }
+      int v0 = (jobs[j].var < 0) ? 0 : jobs[j].var;
+      int v1 = (jobs[j].var < 0) ? names.size() : v0+1;
+      for (size_t p=0; p<pieces.size(); p++){
+        Box part = intersect(tile, shifted(pieces[p].box, pieces[p].shift));
+        if (part.size() == 0)
+          continue;
+        Box stored = part;
+        stored.lo[2] -= pieces[p].shift;
+        stored.hi[2] -= pieces[p].shift;
+        block.resize(part.size());
+        for (int v=v0; v<v1; v++)
+          for (size_t t=0; t<jobs[j].count[0]; t++){
+            size_t rec = jobs[j].dst[0] + t;
+            copyBox(out[v] + rec*slab, box, &block[0], part, part);
+            put(url, names[v], start[0]+rec*stride[0], pieces[p].grid,
+                stored, &block[0]);
+          }
+      }
+    }
+  }
+
+  // Evict least recently used tiles until under the size cap
+  void trim()
+  {
+    std::vector<std::pair<time_t,std::string> > files;
+    std::map<std::string,off_t> sizes;
+    double total = 0;
+    DIR *top = opendir(m_dir.c_str());
+    if (!top)
+      return;
+    struct dirent *e;
+    while ((e = readdir(top))){
+      if (e->d_name[0] == '.')
+        continue;
+      std::string sub = m_dir + "/" + e->d_name;
+      DIR *d = opendir(sub.c_str());
+      if (!d)
+        continue;
+      struct dirent *f;
+      while ((f = readdir(d))){
+        std::string name = f->d_name;
+        if (!isTile(name))
+          continue;
+        std::string path = sub + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+          continue;
+        files.push_back(std::make_pair(st.st_mtime, path));
+        sizes[path] = st.st_size;
+        total += st.st_size;
+      }
+      closedir(d);
+    }
+    closedir(top);
+
+    std::sort(files.begin(), files.end());
+    for (size_t i=0; (i<files.size()) && (total > m_max_bytes); i++){
+      if (unlink(files[i].second.c_str()) == 0){
+        total -= sizes[files[i].second];
+        m_evicted++;
+      }
+    }
+  }
+
+  double hitBytes()  const { return m_hit_bytes; }
+  double missBytes() const { return m_miss_bytes; }
+  int    evicted()   const { return m_evicted; }
+
+ private:
+  // Batch box in points of the strided grid
+  static Box boxOf(const std::vector<size_t> &start,
+                   const std::vector<size_t> &count,
+                   const std::vector<size_t> &stride)
+  {
+    Box b;
+    for (int d=0; d<3; d++){
+      b.lo[d] = start[d+1]/stride[d+1];
+      b.hi[d] = b.lo[d] + count[d+1];
+    }
+    return b;
+  }
+
+  // Spatial stride/phase part of the key ("" on the full grid)
+  static std::string gridOf(const std::vector<size_t> &start,
+                            const std::vector<size_t> &stride)
+  {
+    if ((stride[1] == 1) && (stride[2] == 1) && (stride[3] == 1))
+      return "";
+    std::ostringstream grid;
+    for (int d=1; d<4; d++)
+      grid << " " << stride[d] << "/" << start[d]%stride[d];
+    return grid.str();
+  }
+
+  // The part of a batch box on one side of the lon seam: 'box' in the
+  // indices it is stored under, 'shift' (along lon) to the batch box
+  struct Piece
+  {
+    std::string grid;
+    Box         box;
+    size_t      shift;
+  };
+
+  static Box shifted(Box b, size_t shift)
+  {
+    b.lo[2] += shift;
+    b.hi[2] += shift;
+    return b;
+  }
+
+  // Split the batch box at the seam of a lon axis of size 'wrap'; the
+  // east part restarts at column start + k*stride - wrap, whose phase
+  // differs from the west part's when the stride does not divide wrap
+  static std::vector<Piece> piecesOf(const std::vector<size_t> &start,
+                                     const std::vector<size_t> &count,
+                                     const std::vector<size_t> &stride,
+                                     size_t wrap)
+  {
+    Box whole = boxOf(start, count, stride);
+    size_t s = stride[3], n = count[3], west = n;
+    if ((wrap > 0) && (n > 0) && (start[3] + (n-1)*s >= wrap))
+      west = (start[3] < wrap) ? (wrap - start[3] + s - 1)/s : 0;
+
+    std::vector<Piece> pieces;
+    if (west > 0){
+      Piece p;
+      p.grid = gridOf(start, stride);
+      p.box = whole;
+      p.box.hi[2] = p.box.lo[2] + west;
+      p.shift = 0;
+      pieces.push_back(p);
+    }
+    if (west < n){
+      std::vector<size_t> east(start);
+      east[3] = start[3] + west*s - wrap;
+      Piece p;
+      p.grid = gridOf(east, stride);
+      p.box = whole;
+      p.box.lo[2] = east[3]/s;
+      p.box.hi[2] = p.box.lo[2] + n - west;
+      p.shift = whole.lo[2] + west - p.box.lo[2];
+      pieces.push_back(p);
+    }
+    return pieces;
+  }
+
+  static std::string keyOf(const std::string &url, const std::string &var,
+                           size_t t, const std::string &grid)
+  {
+    std::ostringstream key;
+    key << url << " " << var << " " << t << grid;
+    return key.str();
+  }
+
+  // Directory of one (url, var, time) key: FNV-1a hash of the key
+  std::string keyDir(const std::string &key) const
+  {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i=0; i<key.size(); i++){
+      h ^= (unsigned char)key[i];
+      h *= 1099511628211ULL;
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+    return m_dir + "/" + hex;
+  }
+
+  static std::string tileName(const Box &b)
+  {
+    std::ostringstream name;
+    name << b.lo[0] << "-" << b.hi[0] << "_" << b.lo[1] << "-" << b.hi[1]
+         << "_" << b.lo[2] << "-" << b.hi[2] << ".tile";
+    return name.str();
+  }
+
+  // Copy every cached block overlapping 'piece' into 'dst' (laid out
+  // as the batch box 'batch'); appends the parts of the piece that no
+  // block covered to 'holes', in batch indices.
+  void lookup(const std::string &url, const std::string &var, size_t t,
+              const Piece &piece, const Box &batch, short *dst,
+              std::vector<Box> &holes)
+  {
+    const Box &box = piece.box;
+    std::vector<Box> missing(1, box);
+    std::string key = keyOf(url, var, t, piece.grid);
+    std::string dir = keyDir(key);
+    if (readKey(dir) != key){
+      m_miss_bytes += box.size()*sizeof(short);
+      holes.push_back(shifted(box, piece.shift));
+      return;
+    }
+
+    std::vector<Box> tiles;
+    DIR *d = opendir(dir.c_str());
+    struct dirent *e;
+    while (d && (e = readdir(d))){
+      Box b;
+      unsigned long v[6];
+      if (!isTile(e->d_name) ||
+          (sscanf(e->d_name, "%lu-%lu_%lu-%lu_%lu-%lu.tile",
+                  &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6))
+        continue;
+      for (int k=0; k<3; k++){
+        b.lo[k] = v[2*k];
+        b.hi[k] = v[2*k+1];
+      }
+      if (intersect(b, box).size() > 0)
+        tiles.push_back(b);
+    }
+    if (d)
+      closedir(d);
+
+    std::vector<short> block;
+    for (size_t i=0; (i<tiles.size()) && !missing.empty(); i++){
+      bool useful = false;
+      for (size_t m=0; m<missing.size(); m++)
+        useful = useful || (intersect(tiles[i], missing[m]).size() > 0);
+      if (!useful)
+        continue;
+
+      std::string path = dir + "/" + tileName(tiles[i]);
+      block.resize(tiles[i].size());
+      std::ifstream in(path.c_str(), std::ios::binary);
+      if (!in.read((char*)&block[0], block.size()*sizeof(short)))
+        continue;
+      utime(path.c_str(), NULL); // LRU: mark as recently used
+
+      std::vector<Box> still;
+      for (size_t m=0; m<missing.size(); m++){
+        Box c = intersect(tiles[i], missing[m]);
+        if (c.size() > 0){
+          copyBox(&block[0], shifted(tiles[i], piece.shift), dst, batch,
+                  shifted(c, piece.shift));
+          m_hit_bytes += c.size()*sizeof(short);
+        }
+        subtract(missing[m], tiles[i], still);
+      }
+      missing.swap(still);
+    }
+    for (size_t m=0; m<missing.size(); m++){
+      m_miss_bytes += missing[m].size()*sizeof(short);
+      holes.push_back(shifted(missing[m], piece.shift));
+    }
+  }
+
+  void put(const std::string &url, const std::string &var, size_t t,
+           const std::string &grid, const Box &tile, const short *data)
+  {
+    std::string key = keyOf(url, var, t, grid);
+    std::string dir = keyDir(key);
+    if (readKey(dir) != key){
+      mkdir(dir.c_str(), 0755);
+      std::ofstream k((dir + "/key").c_str());
+      k << key;
+    }
+    // write-then-rename, so concurrent runs never see partial tiles
+    std::string path = dir + "/" + tileName(tile);
+    std::ostringstream tmp;
+    tmp << path << ".tmp" << getpid();
+    std::ofstream out(tmp.str().c_str(), std::ios::binary);
+    out.write((const char*)data, tile.size()*sizeof(short));
+    out.close();
+    if (out)
+      rename(tmp.str().c_str(), path.c_str());
+    else
+      unlink(tmp.str().c_str());
+  }
+
+  // Finished tiles only; "*.tile.tmp<pid>" are still being written
+  static bool isTile(const std::string &name)
+  {
+    return (name.size() > 5) && (name.rfind(".tile") == name.size()-5);
+  }
+
+  static std::string readKey(const std::string &dir)
+  {
+    std::ifstream in((dir + "/key").c_str());
+    std::string key;
+    getline(in, key);
+    return key;
+  }
+
+  std::string m_dir;
+  double      m_max_bytes;
+  double      m_hit_bytes, m_miss_bytes;
+  int         m_evicted;
+};
+
+#endif
@@ -0,0 +1,142 @@
+/************************************************************/
+/*    FILE: hycom_catalog.h                                 */
+/************************************************************/
+
+// Catalog of HYCOM experiments and their time coverage.
+//
+// A date range that spans several GLBv0.08 runs is resolved into one
+// window per experiment.  Where runs overlap, the earlier run keeps the
+// overlap, so every hour is read from exactly one experiment.
+//
+// Catalog file format (--catalog=FILE), one experiment per line:
+//   name  url  first-day  last-day       (days as YYYY-MM-DD)
+// '#' starts a comment.
+
+#ifndef HYCOM_CATALOG_H
+#define HYCOM_CATALOG_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+
+struct Experiment
+{
+  std::string name;
+  std::string url;
+  double t0, t1;  // coverage [t0, t1), hours since 2000-01-01 00:00:00
+};
+
+// Hours from 2000-01-01 to the start of day y/m/d
+inline double hoursSince2000(int y, int m, int d)
+{
+  // days from civil date (proleptic Gregorian)
+  y -= (m <= 2);
+  long era = (y >= 0 ? y : y-399)/400;
+  long yoe = y - era*400;
+  long doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d-1;
+  long doe = yoe*365 + yoe/4 - yoe/100 + doy;
+  long days = era*146097 + doe - 719468;  // since 1970-01-01
+  return 24.0*(days - 10957);             // 10957 days 1970 -> 2000
+}
+
+inline bool parseDay(const std::string &s, double &hours)
+{
+  int y, m, d;
+  if (sscanf(s.c_str(), "%d-%d-%d", &y, &m, &d) != 3)
+    return false;
+  hours = hoursSince2000(y, m, d);
+  return true;
+}
+
+inline Experiment experiment(const std::string &name, const std::string &url,
+                             const std::string &first, const std::string &last)
+{
+  Experiment e;
+  e.name = name;
+  e.url = url;
+  parseDay(first, e.t0);
+  parseDay(last, e.t1);
+  e.t1 += 24; // through the end of the last day
+  return e;
+}
+
+// GLBv0.08 runs on tds.hycom.org
+inline std::vector<Experiment> builtinCatalog()
+{
+  std::string base = "https://tds.hycom.org/thredds/dodsC/GLBv0.08/";
+  std::vector<Experiment> cat;
+  for (int y=1994; y<=2015; y++){
+    std::ostringstream year;
+    year << y;
+    cat.push_back(experiment("expt_53.X/" + year.str(),
+                             base + "expt_53.X/data/" + year.str(),
+                             year.str() + "-01-01", year.str() + "-12-31"));
+  }
+  cat.push_back(experiment("expt_56.3", base + "expt_56.3",
+                           "2014-07-01", "2016-09-30"));
+  cat.push_back(experiment("expt_57.2", base + "expt_57.2",
+                           "2016-05-01", "2017-01-31"));
+  cat.push_back(experiment("expt_92.8", base + "expt_92.8",
+                           "2017-02-01", "2017-05-31"));
+  cat.push_back(experiment("expt_57.7", base + "expt_57.7",
+                           "2017-06-01", "2017-09-30"));
+  cat.push_back(experiment("expt_92.9", base + "expt_92.9",
+                           "2017-10-01", "2017-12-31"));
+  cat.push_back(experiment("expt_93.0", base + "expt_93.0",
+                           "2018-01-01", "2020-02-18"));
+  return cat;
+}
+
+// Read a catalog file; false if it cannot be read or has a bad line
+inline bool loadCatalog(const std::string &path, std::vector<Experiment> &cat)
+{
+  std::ifstream in(path.c_str());
+  if (!in)
+    return false;
+  cat.clear();
+  std::string line;
+  while (getline(in, line)){
+    line = line.substr(0, line.find('#'));
+    std::istringstream ss(line);
+    std::string name, url, first, last;
+    if (!(ss >> name))
+      continue;
+    double t;
+    if (!(ss >> url >> first >> last) || !parseDay(first, t) ||
+        !parseDay(last, t))
+      return false;
+    cat.push_back(experiment(name, url, first, last));
+  }
+  return !cat.empty();
+}
+
+inline bool earlierStart(const Experiment &a, const Experiment &b)
+{
+  return a.t0 < b.t0;
+}
+
+// Experiments needed for [tstart, tstop], in time order, with their
+// windows trimmed so that no two of them overlap
+inline std::vector<Experiment> resolveCatalog(std::vector<Experiment> cat,
+                                              double tstart, double tstop)
+{
+  std::stable_sort(cat.begin(), cat.end(), earlierStart);
+  std::vector<Experiment> used;
+  double covered = -1e30;
+  for (size_t i=0; i<cat.size(); i++){
+    Experiment e = cat[i];
+    e.t0 = std::max(e.t0, covered);
+    if (e.t0 >= e.t1)
+      continue; // entirely inside earlier runs
+    covered = e.t1;
+    if ((e.t1 <= tstart) || (e.t0 > tstop))
+      continue;
+    used.push_back(e);
+  }
+  return used;
+}
+
+#endif
@@ -0,0 +1,579 @@
+/************************************************************/
+/*    FILE: hycom_dap.h                                     */
+/************************************************************/
+
+// Minimal DAP2 client for the OPeNDAP '.dods' endpoint.
+//
+// netcdf-c issues one HTTP request per getVar() call.  DAP2 constraint
+// expressions can project several variables over the same hyperslab,
+// e.g.  expt_93.0.dods?salinity[0:1][0:39][10:20][30:40],water_temp[...]
+// so all requested variables come back in a single response.
+//
+// A '.dods' response is the DDS text, the line "Data:", then the XDR
+// encoded values of every projected variable in dataset order.  Note
+// that XDR has no 16-bit type: each Int16 travels as a big-endian
+// 32-bit integer.
+//
+// The body is decoded as it streams in: each chunk from curl is parsed
+// and the values are byte-swapped (SSSE3 where the CPU has it) straight
+// into the caller's buffers, so no copy of the response is kept.
+//
+// All clients of a process share one curl connection cache (plus DNS
+// and TLS sessions), and ask for gzip/deflate transfer encoding, so
+// consecutive tiles reuse a warm, compressed connection.
+
+#ifndef HYCOM_DAP_H
+#define HYCOM_DAP_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <mutex>
+#include <curl/curl.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#endif
+
+class DapException : public std::runtime_error
+{
+ public:
+  DapException(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// Low 16 bits of n big-endian 32-bit XDR words -> host shorts
+inline void xdrToShortsScalar(const unsigned char *p, short *out, size_t n)
+{
+  for (size_t i=0; i<n; i++, p+=4)
+    out[i] = (short)(((unsigned)p[2] << 8) | p[3]);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// SSSE3: one pshufb per 4 words picks bytes 3,2 of each (x86 is
+// little-endian), so 8 values are converted per iteration
+__attribute__((target("ssse3")))
+inline void xdrToShortsSSSE3(const unsigned char *p, short *out, size_t n)
+{
+  const __m128i lo = _mm_setr_epi8(3, 2, 7, 6, 11, 10, 15, 14,
+                                   -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                   3, 2, 7, 6, 11, 10, 15, 14);
+  size_t i = 0;
+  for (; i+8 <= n; i+=8){
+    __m128i a = _mm_loadu_si128((const __m128i*)(p + 4*i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(p + 4*i + 16));
+    __m128i v = _mm_or_si128(_mm_shuffle_epi8(a, lo),
+                             _mm_shuffle_epi8(b, hi));
+    _mm_storeu_si128((__m128i*)(out + i), v);
+  }
+  xdrToShortsScalar(p + 4*i, out + i, n - i);
+}
+#endif
+
+inline void xdrToShorts(const unsigned char *p, short *out, size_t n)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  static const bool ssse3 = __builtin_cpu_supports("ssse3");
+  if (ssse3){
+    xdrToShortsSSSE3(p, out, n);
+    return;
+  }
+#endif
+  xdrToShortsScalar(p, out, n);
+}
+
+// true for datasets behind a DAP server (as opposed to local files)
+inline bool isRemote(const std::string &url)
+{
+  return (url.compare(0, 7, "http://") == 0) ||
+         (url.compare(0, 8, "https://") == 0);
+}
+
+// Transfer counters of DAP requests
+struct DapStats
+{
+  long   requests;
+  long   connects; // new connections; the other requests reused one
+  double wire;     // body bytes received (compressed)
+  double body;     // body bytes after transfer decoding
+
+  DapStats() : requests(0), connects(0), wire(0), body(0) {}
+
+  DapStats& operator+=(const DapStats &o)
+  {
+    requests += o.requests;
+    connects += o.connects;
+    wire += o.wire;
+    body += o.body;
+    return *this;
+  }
+
+  long   reused() const { return std::max(requests - connects, 0L); }
+  double ratio()  const { return (wire > 0) ? body/wire : 1; }
+};
+
+// Connection cache, DNS and TLS sessions shared by the process's
+// clients (the fetch thread and main may both hold one)
+inline CURLSH* dapShare()
+{
+  static std::mutex locks[CURL_LOCK_DATA_LAST];
+  struct Lock {
+    static void lock(CURL*, curl_lock_data d, curl_lock_access, void*)
+    { locks[d].lock(); }
+    static void unlock(CURL*, curl_lock_data d, void*)
+    { locks[d].unlock(); }
+  };
+  static CURLSH *share = NULL;
+  static std::once_flag once;
+  std::call_once(once, [](){
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, Lock::lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, Lock::unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  });
+  return share;
+}
+
+// A request fails when no connection is made within
+// DAP_CONNECT_TIMEOUT s, or when the transfer stalls (under 1 byte/s)
+// for DAP_STALL_TIMEOUT s, instead of hanging the run
+static const long DAP_CONNECT_TIMEOUT = 30;
+static const long DAP_STALL_TIMEOUT = 60;
+
+// Persistent, compressed transfers on handle 'curl'
+inline void dapConnection(CURL *curl)
+{
+  curl_easy_setopt(curl, CURLOPT_SHARE, dapShare());
+  curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, ""); // all curl supports
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, DAP_CONNECT_TIMEOUT);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, DAP_STALL_TIMEOUT);
+}
+
+class DapClient
+{
+ public:
+  DapClient(const std::string &url) : m_url(url)
+  {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    m_curl = curl_easy_init();
+    if (!m_curl)
+      throw DapException("DAP: curl_easy_init failed");
+    dapConnection(m_curl);
+  }
+
+  ~DapClient(){ curl_easy_cleanup(m_curl); }
+
+  // Read the same hyperslab of every variable in 'names' with ONE
+  // request; values of names[v] are stored in out[v] (packed shorts).
+  // count[d] points are read 'stride[d]' source indices apart.
+  void getVars(const std::vector<std::string> &names,
+               const std::vector<size_t> &start,
+               const std::vector<size_t> &count,
+               const std::vector<size_t> &stride,
+               const std::vector<short*> &out)
+  {
+    std::vector<size_t> rows(count[0]*count[1]*count[2]);
+    for (size_t r=0; r<rows.size(); r++)
+      rows[r] = r*count[3];
+    read(names, start, count, stride, out, rows);
+  }
+
+  // As getVars(), but the block is written at position 'dst' of the
+  // cubes out[v] with extents 'cube' (e.g. the batch buffers)
+  void getVarsInto(const std::vector<std::string> &names,
+                   const std::vector<size_t> &start,
+                   const std::vector<size_t> &count,
+                   const std::vector<size_t> &stride,
+                   const std::vector<short*> &out,
+                   const std::vector<size_t> &cube, const size_t *dst)
+  {
+    std::vector<size_t> rows;
+    for (size_t t=0; t<count[0]; t++)
+      for (size_t i=0; i<count[1]; i++)
+        for (size_t j=0; j<count[2]; j++)
+          rows.push_back((((dst[0]+t)*cube[1] + dst[1]+i)*cube[2]
+                          + dst[2]+j)*cube[3] + dst[3]);
+    read(names, start, count, stride, out, rows);
+  }
+
+  int requestCount() const { return m_stats.requests; }
+  const DapStats& stats() const { return m_stats; }
+
+ private:
+  // One DDS declaration, e.g. "Int16 salinity[time = 1][depth = 40];"
+  struct Decl {
+    std::string type;  // Int16, Float32, ...
+    std::string name;  // declared name
+    std::string top;   // enclosing top-level variable (Grid) name
+    size_t n;          // number of values
+    bool array;        // has dimensions
+  };
+
+  // Decoder state of one streamed '.dods' response
+  enum Phase { HEADER, VALUES, SKIP };
+  struct Stream {
+    CURL *curl;
+    const std::vector<std::string> *names;
+    const std::vector<short*>      *out;
+    const std::vector<size_t>      *rows; // destination offset per row
+    size_t rowlen;                        // values per row
+    size_t nvals;                         // values per variable
+    long status;                          // HTTP response code
+    std::string head;                     // DDS text (or error page)
+    bool data;                            // past the "Data:" line
+    std::vector<Decl> decls;
+    std::vector<int>  var;                // output of each decl, -1 = skip
+    std::vector<bool> found;
+    size_t decl;                          // current declaration
+    Phase  phase;
+    size_t left;                          // bytes (HEADER/SKIP) or values due
+    size_t vi;                            // next value of the declaration
+    unsigned char carry[8];               // a word split between chunks
+    size_t ncarry;
+    std::string error;
+    double body;                          // decoded body bytes
+  };
+
+  std::string constraintURL(const std::vector<std::string> &names,
+                            const std::vector<size_t> &start,
+                            const std::vector<size_t> &count,
+                            const std::vector<size_t> &stride) const
+  {
+    // Brackets are percent-encoded; THREDDS rejects them raw
+    std::ostringstream url;
+    url << m_url << ".dods?";
+    for (size_t n=0; n<names.size(); n++){
+      if (n > 0)
+        url << ",";
+      url << names[n];
+      for (size_t d=0; d<start.size(); d++)
+        url << "%5B" << start[d] << ":" << stride[d] << ":"
+            << start[d]+(count[d]-1)*stride[d] << "%5D";
+    }
+    return url.str();
+  }
+
+  // One request; the body is decoded while it arrives, so neither the
+  // response nor the unpacked block is ever held in an extra buffer
+  void read(const std::vector<std::string> &names,
+            const std::vector<size_t> &start,
+            const std::vector<size_t> &count,
+            const std::vector<size_t> &stride,
+            const std::vector<short*> &out,
+            const std::vector<size_t> &rows)
+  {
+    std::string url = constraintURL(names, start, count, stride);
+    Stream s;
+    s.curl = m_curl;
+    s.names = &names;
+    s.out = &out;
+    s.rows = &rows;
+    s.rowlen = count[3];
+    s.nvals = count[0]*count[1]*count[2]*count[3];
+    s.status = 0;
+    s.data = false;
+    s.found.assign(names.size(), false);
+    s.body = 0;
+    s.decl = 0;
+    s.ncarry = 0;
+
+    curl_easy_setopt(m_curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, writeStream);
+    curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, &s);
+
+    CURLcode res = curl_easy_perform(m_curl);
+    long connects = 0;
+    curl_off_t wire = 0;
+    curl_easy_getinfo(m_curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(m_curl, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+    m_stats.requests++;
+    m_stats.connects += connects;
+    m_stats.wire += wire;
+    m_stats.body += s.body;
+    if (!s.error.empty())
+      throw DapException(s.error + " [" + url + "]");
+    if (res != CURLE_OK)
+      throw DapException(std::string("DAP: ") + curl_easy_strerror(res)
+                         + " [" + url + "]");
+    if (s.status != 200)
+      throw DapException("DAP: HTTP error [" + url + "]\n"
+                         + s.head.substr(0, 512));
+    if (!s.data)
+      throw DapException("DAP: bad response from " + m_url + "\n"
+                         + s.head.substr(0, 512));
+    if (s.decl < s.decls.size())
+      throw DapException("DAP: truncated data for " + s.decls[s.decl].name);
+    for (size_t n=0; n<names.size(); n++)
+      if (!s.found[n])
+        throw DapException("DAP: variable missing in response: "+names[n]);
+  }
+
+  static size_t writeStream(char *ptr, size_t size, size_t nmemb, void *user)
+  {
+    Stream &s = *(Stream*)user;
+    const unsigned char *p = (const unsigned char*)ptr;
+    size_t n = size*nmemb;
+    s.body += n;
+    try{
+      if (!s.data){
+        if (s.status == 0)
+          curl_easy_getinfo(s.curl, CURLINFO_RESPONSE_CODE, &s.status);
+        size_t old = s.head.size();
+        if (s.status != 200){
+          if (old < 4096)
+            s.head.append(ptr, n); // start of the error page
+          return size*nmemb;
+        }
+        s.head.append(ptr, n);
+        size_t mark = s.head.find("\nData:\n", (old > 6) ? old-6 : 0);
+        if (mark == std::string::npos)
+          return size*nmemb;
+        s.head.resize(mark);
+        s.data = true;
+        begin(s);
+        size_t used = mark + 7 - old; // bytes of this chunk up to the data
+        p += used;
+        n -= used;
+      }
+      feed(s, p, n);
+    }
+    catch(std::exception &e){
+      s.error = e.what();
+      return 0; // aborts the transfer
+    }
+    return size*nmemb;
+  }
+
+  // DDS is complete: map declarations to outputs
+  static void begin(Stream &s)
+  {
+    s.decls = parseDDS(s.head);
+    for (size_t i=0; i<s.decls.size(); i++){
+      int v = -1;
+      for (size_t n=0; n<s.names->size(); n++)
+        if ((s.decls[i].top == (*s.names)[n]) &&
+            (s.decls[i].name == (*s.names)[n]))
+          v = n;
+      if ((v >= 0) && (s.decls[i].n != s.nvals))
+        throw DapException("DAP: unexpected size for " + (*s.names)[v]);
+      s.var.push_back(v);
+    }
+    startDecl(s);
+  }
+
+  static void startDecl(Stream &s)
+  {
+    if (s.decl >= s.decls.size())
+      return;
+    s.ncarry = 0;
+    if (s.decls[s.decl].array){
+      s.phase = HEADER;   // two 32-bit length words
+      s.left = 8;
+    }
+    else
+      startValues(s);
+  }
+
+  static void startValues(Stream &s)
+  {
+    const Decl &d = s.decls[s.decl];
+    if (s.var[s.decl] < 0){
+      s.phase = SKIP;
+      s.left = dataBytes(d);
+    }
+    else{
+      if ((d.type != "Int16") && (d.type != "UInt16"))
+        throw DapException("DAP: expected packed Int16 for " + d.name
+                           + ", got " + d.type);
+      s.found[s.var[s.decl]] = true;
+      s.phase = VALUES;
+      s.left = d.n;
+      s.vi = 0;
+    }
+    if (s.left == 0)
+      nextDecl(s);
+  }
+
+  static void nextDecl(Stream &s)
+  {
+    s.decl++;
+    startDecl(s);
+  }
+
+  // Consume the next n bytes of the XDR data
+  static void feed(Stream &s, const unsigned char *p, size_t n)
+  {
+    while ((n > 0) && (s.decl < s.decls.size())){
+      if (s.phase == HEADER){
+        size_t k = std::min(n, s.left);
+        memcpy(s.carry + s.ncarry, p, k);
+        s.ncarry += k;
+        s.left -= k;
+        p += k;
+        n -= k;
+        if (s.left == 0){
+          if (be32(s.carry) != s.decls[s.decl].n)
+            throw DapException("DAP: malformed data for "
+                               + s.decls[s.decl].name);
+          s.ncarry = 0;
+          startValues(s);
+        }
+      }
+      else if (s.phase == SKIP){
+        size_t k = std::min(n, s.left);
+        s.left -= k;
+        p += k;
+        n -= k;
+        if (s.left == 0)
+          nextDecl(s);
+      }
+      else if (s.ncarry > 0){          // complete a split word
+        size_t k = std::min(n, 4 - s.ncarry);
+        memcpy(s.carry + s.ncarry, p, k);
+        s.ncarry += k;
+        p += k;
+        n -= k;
+        if (s.ncarry == 4){
+          s.ncarry = 0;
+          store(s, s.carry, 1);
+        }
+      }
+      else{
+        size_t k = std::min(n/4, s.left);
+        if (k == 0){                   // fewer than 4 bytes left
+          memcpy(s.carry, p, n);
+          s.ncarry = n;
+          return;
+        }
+        store(s, p, k);
+        p += 4*k;
+        n -= 4*k;
+      }
+    }
+  }
+
+  // Decode k XDR words straight into the destination rows
+  static void store(Stream &s, const unsigned char *p, size_t k)
+  {
+    short *out = (*s.out)[s.var[s.decl]];
+    while (k > 0){
+      size_t row = s.vi/s.rowlen, col = s.vi%s.rowlen;
+      size_t m = std::min(k, s.rowlen - col);
+      xdrToShorts(p, out + (*s.rows)[row] + col, m);
+      p += 4*m;
+      k -= m;
+      s.vi += m;
+      s.left -= m;
+    }
+    if (s.left == 0)
+      nextDecl(s);
+  }
+
+  static std::vector<Decl> parseDDS(const std::string &dds)
+  {
+    std::vector<Decl> decls;
+    std::istringstream in(dds);
+    std::string line;
+    int depth = 0;
+    size_t group = 0; // first declaration of the open top-level group
+
+    while (getline(in, line)){
+      size_t b = line.find_first_not_of(" \t");
+      if (b == std::string::npos)
+        continue;
+      line = line.substr(b);
+
+      if (line[line.size()-1] == '{'){        // Dataset, Grid, Structure
+        if (line.find("Sequence") == 0)
+          throw DapException("DAP: sequences are not supported");
+        if (depth == 1)
+          group = decls.size();
+        depth++;
+        continue;
+      }
+      if (line[0] == '}'){                     // "} name;"
+        depth--;
+        if (depth == 1){
+          std::string name = line.substr(1);
+          name = name.substr(name.find_first_not_of(" "));
+          name = name.substr(0, name.find(';'));
+          for (size_t i=group; i<decls.size(); i++)
+            decls[i].top = name;
+        }
+        continue;
+      }
+      if (line[line.size()-1] == ':')          // ARRAY: / MAPS:
+        continue;
+
+      Decl d;
+      std::istringstream tok(line.substr(0, line.find(';')));
+      tok >> d.type >> d.name;
+      d.n = 1;
+      d.array = false;
+      size_t br = d.name.find('[');
+      if (br != std::string::npos)
+        d.name = d.name.substr(0, br);
+      // dimensions: [name = size] or [size]
+      size_t pos = line.find('[');
+      while (pos != std::string::npos){
+        size_t close = line.find(']', pos);
+        std::string dim = line.substr(pos+1, close-pos-1);
+        size_t eq = dim.find('=');
+        if (eq != std::string::npos)
+          dim = dim.substr(eq+1);
+        d.n *= strtoul(dim.c_str(), NULL, 10);
+        d.array = true;
+        pos = line.find('[', close);
+      }
+      d.top = d.name;
+      decls.push_back(d);
+    }
+    return decls;
+  }
+
+  static size_t xdrSize(const std::string &type)
+  {
+    if (type == "Byte")    return 1;
+    if (type == "Float64") return 8;
+    if ((type == "Int16") || (type == "UInt16") || (type == "Int32")
+        || (type == "UInt32") || (type == "Float32"))
+      return 4;
+    throw DapException("DAP: unsupported type " + type);
+  }
+
+  static uint32_t be32(const unsigned char *p)
+  {
+    return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16)
+      | ((uint32_t)p[2]<<8) | (uint32_t)p[3];
+  }
+
+  // Bytes of a declaration's values (after the array length words)
+  static size_t dataBytes(const Decl &d)
+  {
+    size_t bytes = d.n*xdrSize(d.type);
+    if ((d.type == "Byte") && d.array)
+      bytes = (bytes + 3) & ~(size_t)3;       // opaque, padded to 4
+    else if (d.type == "Byte")
+      bytes = 4;
+    return bytes;
+  }
+
+  std::string m_url;
+  CURL       *m_curl;
+  DapStats    m_stats;
+};
+
+#endif
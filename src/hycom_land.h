@@ -0,0 +1,351 @@
+/************************************************************/
+/*    FILE: hycom_land.h                                    */
+/************************************************************/
+
+// Learned land index: skip tiles that are all land.
+//
+// Much of a GLBv0.08 box is land, where every value comes back as
+// missing_value and is still transferred.  HYCOM's land mask does not
+// change with time, so LandIndex cuts each depth level of the grid
+// into LAND_TILE x LAND_TILE cells and remembers which are land (all
+// points missing) and which hold ocean:
+//   - a fetched block marks every cell with an ocean point, in any
+//     variable and record, OCEAN;
+//   - a record in which one block covered every point of a cell and
+//     every variable was missing there is one vote for land; a cell
+//     becomes LAND after LAND_RECORDS votes, so one bad or empty
+//     record cannot remove ocean;
+//   - cells never seen stay UNKNOWN and are fetched.
+// trimJob() removes the margins of a job that fall on LAND cells, or
+// the whole job; the caller fills those points with the missing value.
+//
+// The index is kept per dataset (source URL, so per experiment) and
+// grid (a hash of the depth/lat/lon axes) in the metadata directory;
+// deleting the file forgets what was learned.
+//
+// Layout:  DIR/<hash of URL and axes>.land
+//          "HYCOM_LAND 2\n" "<nz> <ny> <nx> <tile>\n" then one byte per
+//          cell [depth][lat cell][lon cell], then the land votes of
+//          each cell, one byte each
+
+#ifndef HYCOM_LAND_H
+#define HYCOM_LAND_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <sys/stat.h>
+#include "hycom_tiles.h"
+
+static const size_t LAND_TILE = 32;   // grid points per cell side
+static const int    LAND_RECORDS = 8; // all-missing records to be LAND
+
+class LandIndex
+{
+ public:
+  enum Cell { UNKNOWN = 0, LAND = 1, OCEAN = 2 };
+  enum Trim { KEEP, TRIMMED, SKIP };
+
+  // Indexes of datasets 'urls' (indexed by FetchJob::src) on the grid
+  // with these axes, loaded from 'dir' ("" = kept in memory only)
+  LandIndex(const std::string &dir, const std::vector<std::string> &urls,
+            const float *depth, size_t nz, const float *lat, size_t ny,
+            const float *lon, size_t nx)
+    : m_dir(dir), m_urls(urls), m_nz(nz), m_ny(ny), m_nx(nx),
+      m_cy((ny + LAND_TILE - 1)/LAND_TILE),
+      m_cx((nx + LAND_TILE - 1)/LAND_TILE), m_grid(14695981039346656037ULL),
+      m_tables(urls.size(), -1), m_skipped(0), m_saved(0)
+  {
+    hash(m_grid, depth, nz*sizeof(float));
+    hash(m_grid, lat, ny*sizeof(float));
+    hash(m_grid, lon, nx*sizeof(float));
+  }
+
+  // Drop the LAND margins of 'job' (of 'nvars' variables) along depth,
+  // lat and lon; SKIP when nothing is left to fetch
+  Trim trimJob(FetchJob &job, int nvars)
+  {
+    Table &tab = table(job.src);
+    size_t lo[4], hi[4];
+    for (int d=0; d<4; d++){
+      lo[d] = 0;
+      hi[d] = job.count[d];
+    }
+    if (allLand(tab, job, lo, hi)){
+      m_skipped++;
+      m_saved += jobBytes(job, nvars);
+      return SKIP;
+    }
+
+    double before = jobBytes(job, nvars);
+    for (int d=1; d<4; d++){
+      // low end: whole cells at a time
+      while (lo[d] < hi[d]){
+        size_t next = nextCell(job, d, lo[d]);
+        size_t l[4], h[4];
+        std::copy(lo, lo+4, l);
+        std::copy(hi, hi+4, h);
+        h[d] = std::min(next, hi[d]);
+        if (!allLand(tab, job, l, h))
+          break;
+        lo[d] = h[d];
+      }
+      // high end
+      while (hi[d] > lo[d]){
+        size_t first = firstOfCell(job, d, hi[d]-1);
+        size_t l[4], h[4];
+        std::copy(lo, lo+4, l);
+        std::copy(hi, hi+4, h);
+        l[d] = std::max(first, lo[d]);
+        if (!allLand(tab, job, l, h))
+          break;
+        hi[d] = l[d];
+      }
+    }
+    bool trimmed = false;
+    for (int d=1; d<4; d++){
+      if ((lo[d] == 0) && (hi[d] == job.count[d]))
+        continue;
+      job.start[d] += lo[d]*job.stride[d];
+      job.dst[d] += lo[d];
+      job.count[d] = hi[d] - lo[d];
+      trimmed = true;
+    }
+    m_saved += before - jobBytes(job, nvars);
+    return trimmed ? TRIMMED : KEEP;
+  }
+
+  // Learn from a block of the grid (a job or a whole run of dataset
+  // job.src; lon indices may continue past the seam) placed in the
+  // cubes[v] of extents 'extent', one per variable; points equal to
+  // missing[v] are land
+  void learn(const FetchJob &job, const std::vector<short*> &cubes,
+             const std::vector<size_t> &extent, const short *missing)
+  {
+    Table &tab = table(job.src);
+    // points seen and ocean points per cell of the block's lat band
+    size_t cy0 = job.start[2]/LAND_TILE;
+    size_t ncy = (job.start[2] + (job.count[2]-1)*job.stride[2])/LAND_TILE
+      - cy0 + 1;
+    std::vector<size_t> seen(ncy*m_cx), ocean(ncy*m_cx);
+
+    for (size_t i=0; i<job.count[1]; i++){
+      size_t z = job.start[1] + i*job.stride[1];
+      for (size_t t=0; t<job.count[0]; t++){
+        std::fill(seen.begin(), seen.end(), 0);
+        std::fill(ocean.begin(), ocean.end(), 0);
+        for (size_t j=0; j<job.count[2]; j++){
+          size_t row = ((job.dst[0]+t)*extent[1] + job.dst[1]+i)*extent[2]
+            + job.dst[2]+j;
+          size_t cy = (job.start[2] + j*job.stride[2])/LAND_TILE - cy0;
+          for (size_t k=0; k<job.count[3]; k++){
+            size_t c = cy*m_cx +
+              (job.start[3] + k*job.stride[3])%m_nx/LAND_TILE;
+            seen[c]++;
+            for (size_t v=0; v<cubes.size(); v++)
+              ocean[c] += (cubes[v][row*extent[3] + job.dst[3]+k]
+                           != missing[v]);
+          }
+        }
+        for (size_t cy=0; cy<ncy; cy++)
+          for (size_t cx=0; cx<m_cx; cx++){
+            size_t c = cy*m_cx + cx;
+            size_t n = cell(z, cy0+cy, cx);
+            if (ocean[c] > 0){
+              if (tab.cells[n] != OCEAN){
+                tab.cells[n] = OCEAN;
+                tab.dirty = true;
+              }
+            }
+            else if ((tab.cells[n] == UNKNOWN) &&
+                     (seen[c] == area(cy0+cy, cx))){
+              if (++tab.votes[n] >= LAND_RECORDS)
+                tab.cells[n] = LAND;
+              tab.dirty = true;
+            }
+          }
+      }
+    }
+  }
+
+  // Write the index files that learned anything
+  void save()
+  {
+    for (size_t n=0; n<m_loaded.size(); n++){
+      Table &tab = m_loaded[n];
+      if (tab.path.empty() || !tab.dirty)
+        continue;
+      mkdir(m_dir.c_str(), 0755);
+      std::string tmp = tab.path + ".tmp";
+      std::ofstream out(tmp.c_str(), std::ios::binary);
+      out << "HYCOM_LAND 2\n" << m_nz << " " << m_ny << " " << m_nx << " "
+          << LAND_TILE << "\n";
+      out.write((const char*)&tab.cells[0], tab.cells.size());
+      out.write((const char*)&tab.votes[0], tab.votes.size());
+      out.close();
+      if (out)
+        rename(tmp.c_str(), tab.path.c_str());
+      tab.dirty = false;
+    }
+  }
+
+  int    skipped()    const { return m_skipped; } // jobs not fetched
+  double savedBytes() const { return m_saved; }   // payload not fetched
+
+  // Fraction of cells known to be land or ocean, over the datasets used
+  double known()
+  {
+    for (size_t s=0; s<m_urls.size(); s++)
+      table(s);
+    size_t n = 0, total = 0;
+    for (size_t t=0; t<m_loaded.size(); t++){
+      const std::vector<unsigned char> &cells = m_loaded[t].cells;
+      for (size_t c=0; c<cells.size(); c++)
+        n += (cells[c] != UNKNOWN);
+      total += cells.size();
+    }
+    return total ? (double)n/total : 0;
+  }
+
+ private:
+  // Cells of one dataset
+  struct Table
+  {
+    std::string url, path;
+    std::vector<unsigned char> cells, votes;
+    bool dirty;
+  };
+
+  static void hash(uint64_t &h, const void *data, size_t bytes)
+  {
+    const unsigned char *p = (const unsigned char*)data;
+    for (size_t i=0; i<bytes; i++){
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+  }
+
+  // Table of dataset 'src', loaded on first use; sources with the same
+  // URL share one
+  Table& table(int src)
+  {
+    if (m_tables[src] >= 0)
+      return m_loaded[m_tables[src]];
+    for (size_t t=0; t<m_loaded.size(); t++)
+      if (m_loaded[t].url == m_urls[src]){
+        m_tables[src] = t;
+        return m_loaded[t];
+      }
+    Table tab;
+    tab.url = m_urls[src];
+    tab.cells.assign(m_nz*m_cy*m_cx, UNKNOWN);
+    tab.votes.assign(tab.cells.size(), 0);
+    tab.dirty = false;
+    if (!m_dir.empty()){
+      uint64_t h = m_grid;
+      hash(h, tab.url.data(), tab.url.size());
+      char name[32];
+      snprintf(name, sizeof(name), "%016llx.land", (unsigned long long)h);
+      tab.path = m_dir + "/" + name;
+      load(tab);
+    }
+    m_tables[src] = m_loaded.size();
+    m_loaded.push_back(tab);
+    return m_loaded.back();
+  }
+
+  void load(Table &tab) const
+  {
+    std::ifstream in(tab.path.c_str(), std::ios::binary);
+    std::string magic;
+    size_t z = 0, y = 0, x = 0, tile = 0;
+    if (!getline(in, magic) || (magic != "HYCOM_LAND 2"))
+      return;
+    if (!(in >> z >> y >> x >> tile) || (z != m_nz) || (y != m_ny) ||
+        (x != m_nx) || (tile != LAND_TILE))
+      return;
+    in.get(); // newline before the cells
+    std::vector<unsigned char> cells(tab.cells.size());
+    std::vector<unsigned char> votes(tab.votes.size());
+    if (in.read((char*)&cells[0], cells.size()) &&
+        in.read((char*)&votes[0], votes.size())){
+      tab.cells.swap(cells);
+      tab.votes.swap(votes);
+    }
+  }
+
+  // Position of cell (z, cy, cx) in a table
+  size_t cell(size_t z, size_t cy, size_t cx) const
+  {
+    return (z*m_cy + cy)*m_cx + cx;
+  }
+
+  // Grid points in cell (cy, cx); cells at the far edges are smaller
+  size_t area(size_t cy, size_t cx) const
+  {
+    return (std::min((cy+1)*LAND_TILE, m_ny) - cy*LAND_TILE)*
+      (std::min((cx+1)*LAND_TILE, m_nx) - cx*LAND_TILE);
+  }
+
+  // Cell of point 'p' of 'job' along dimension 'd' (depth levels are
+  // cells of their own)
+  static size_t cellOf(const FetchJob &job, int d, size_t p)
+  {
+    size_t i = job.start[d] + p*job.stride[d];
+    return (d == 1) ? i : i/LAND_TILE;
+  }
+
+  // First point of 'job' along 'd' past the cell of point 'p'
+  static size_t nextCell(const FetchJob &job, int d, size_t p)
+  {
+    if (d == 1)
+      return p+1;
+    size_t edge = (cellOf(job, d, p) + 1)*LAND_TILE; // source index
+    return (edge - job.start[d] + job.stride[d] - 1)/job.stride[d];
+  }
+
+  // First point of 'job' along 'd' in the cell of point 'p'
+  static size_t firstOfCell(const FetchJob &job, int d, size_t p)
+  {
+    if (d == 1)
+      return p;
+    size_t edge = cellOf(job, d, p)*LAND_TILE;
+    if (edge <= job.start[d])
+      return 0;
+    return (edge - job.start[d] + job.stride[d] - 1)/job.stride[d];
+  }
+
+  // Every cell under points [lo,hi) of 'job' is LAND
+  bool allLand(const Table &tab, const FetchJob &job, const size_t *lo,
+               const size_t *hi) const
+  {
+    for (int d=1; d<4; d++)
+      if (lo[d] >= hi[d])
+        return true;
+    size_t y0 = cellOf(job, 2, lo[2]), y1 = cellOf(job, 2, hi[2]-1);
+    size_t x0 = cellOf(job, 3, lo[3]), x1 = cellOf(job, 3, hi[3]-1);
+    for (size_t i=lo[1]; i<hi[1]; i++){
+      size_t z = cellOf(job, 1, i);
+      for (size_t cy=y0; cy<=y1; cy++)
+        for (size_t cx=x0; cx<=x1; cx++)
+          if (tab.cells[cell(z, cy, cx)] != LAND)
+            return false;
+    }
+    return true;
+  }
+
+  std::string              m_dir;
+  std::vector<std::string> m_urls;
+  size_t                   m_nz, m_ny, m_nx, m_cy, m_cx;
+  uint64_t                 m_grid;   // hash of the axes
+  std::vector<int>         m_tables; // source -> m_loaded
+  std::vector<Table>       m_loaded;
+  int                      m_skipped;
+  double                   m_saved;
+};
+
+#endif
@@ -0,0 +1,210 @@
+/************************************************************/
+/*    FILE: hycom_meta.h                                    */
+/************************************************************/
+
+// Local cache of coordinate axes and variable attributes.
+//
+// Sections 3-5 read the full depth/lat/lon/time axes plus scale_factor,
+// add_offset, missing_value and units over the network on every run.
+// DatasetMeta keeps them in one small file per dataset URL.  The file
+// is trusted while it is younger than the TTL AND every axis still has
+// the length the server reports (dimension sizes come with the DDS,
+// which opening the dataset has already fetched); an aggregation that
+// grew by one record is therefore re-read.
+
+#ifndef HYCOM_META_H
+#define HYCOM_META_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <sys/stat.h>
+#include <netcdf>
+
+class DatasetMeta
+{
+ public:
+  DatasetMeta() : m_dirty(false), m_hit(false) {}
+
+  // Load the cache file of 'url' from 'dir' ("" = no cache)
+  void load(const std::string &dir, const std::string &url,
+            double ttl_hours)
+  {
+    m_dir = dir;
+    m_path = dir.empty() ? "" : pathFor(dir, url);
+    m_url = url;
+    if (m_path.empty())
+      return;
+
+    std::ifstream in(m_path.c_str(), std::ios::binary);
+    std::string magic, key, line;
+    long saved = 0;
+    if (!getline(in, magic) || (magic != "HYCOM_META 1"))
+      return;
+    if (!getline(in, key) || (key != "url " + url))
+      return;
+    if (!(in >> line >> saved) || (line != "saved"))
+      return;
+    if (difftime(time(NULL), (time_t)saved) > ttl_hours*3600)
+      return; // expired
+
+    std::string kind, name;
+    while (in >> kind){
+      if (kind == "end"){
+        m_hit = true;
+        return;
+      }
+      in >> name;
+      if (kind == "axis"){
+        size_t n = 0;
+        in >> n;
+        in.get(); // newline before the binary values
+        std::vector<float> &axis = m_axes[name];
+        axis.resize(n);
+        in.read((char*)&axis[0], n*sizeof(float));
+      }
+      else if (kind == "att"){
+        float value;
+        in >> value;
+        m_atts[name] = value;
+      }
+      else if (kind == "text"){
+        in.get();
+        getline(in, m_text[name]);
+      }
+    }
+    clear(); // truncated file
+  }
+
+  // Keep the cached entries only if every axis length still matches
+  void check(const netCDF::NcFile &file)
+  {
+    std::map<std::string,std::vector<float> >::iterator it;
+    for (it=m_axes.begin(); it!=m_axes.end(); ++it){
+      netCDF::NcVar var = file.getVar(it->first);
+      if (var.isNull() || (var.getDim(0).getSize() != it->second.size())){
+        clear();
+        return;
+      }
+    }
+  }
+
+  // Coordinate axis 'var' into 'values' (n entries)
+  void axis(const netCDF::NcVar &var, float *values, size_t n)
+  {
+    std::vector<float> &axis = m_axes[var.getName()];
+    if (axis.size() != n){
+      axis.resize(n);
+      var.getVar(&axis[0]);
+      m_dirty = true;
+    }
+    std::copy(axis.begin(), axis.end(), values);
+  }
+
+  // true if axis 'name' is held by the cache
+  bool hasAxis(const std::string &name) const
+  {
+    return m_axes.count(name) && !m_axes.find(name)->second.empty();
+  }
+
+  // Numeric attribute; false if the variable has no such attribute
+  bool att(const netCDF::NcVar &var, const std::string &name, float *value)
+  {
+    std::string key = var.getName() + ":" + name;
+    if (!m_atts.count(key)){
+      netCDF::NcVarAtt att = var.getAtt(name);
+      if (att.isNull())
+        return false;
+      att.getValues(value);
+      m_atts[key] = value[0];
+      m_dirty = true;
+    }
+    value[0] = m_atts[key];
+    return true;
+  }
+
+  // Text attribute (e.g. units); false if missing
+  bool text(const netCDF::NcVar &var, const std::string &name,
+            std::string &value)
+  {
+    std::string key = var.getName() + ":" + name;
+    if (!m_text.count(key)){
+      netCDF::NcVarAtt att = var.getAtt(name);
+      if (att.isNull())
+        return false;
+      att.getValues(value);
+      m_text[key] = value;
+      m_dirty = true;
+    }
+    value = m_text[key];
+    return true;
+  }
+
+  // Write the cache file if anything had to be read from the server
+  void save()
+  {
+    if (m_path.empty() || !m_dirty)
+      return;
+    mkdir(m_dir.c_str(), 0755);
+    std::string tmp = m_path + ".tmp";
+    std::ofstream out(tmp.c_str(), std::ios::binary);
+    out.precision(9);
+    out << "HYCOM_META 1\n" << "url " << m_url << "\n"
+        << "saved " << (long)time(NULL) << "\n";
+    std::map<std::string,std::vector<float> >::iterator a;
+    for (a=m_axes.begin(); a!=m_axes.end(); ++a){
+      out << "axis " << a->first << " " << a->second.size() << "\n";
+      out.write((const char*)&a->second[0], a->second.size()*sizeof(float));
+      out << "\n";
+    }
+    std::map<std::string,float>::iterator f;
+    for (f=m_atts.begin(); f!=m_atts.end(); ++f)
+      out << "att " << f->first << " " << f->second << "\n";
+    std::map<std::string,std::string>::iterator t;
+    for (t=m_text.begin(); t!=m_text.end(); ++t)
+      out << "text " << t->first << "\n" << t->second << "\n";
+    out << "end\n";
+    out.close();
+    if (out)
+      rename(tmp.c_str(), m_path.c_str());
+    m_dirty = false;
+  }
+
+  // true when startup was served from the cache file
+  bool hit() const { return m_hit && !m_dirty; }
+
+ private:
+  void clear()
+  {
+    m_axes.clear();
+    m_atts.clear();
+    m_text.clear();
+    m_hit = false;
+  }
+
+  static std::string pathFor(const std::string &dir, const std::string &url)
+  {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i=0; i<url.size(); i++){
+      h ^= (unsigned char)url[i];
+      h *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.meta", (unsigned long long)h);
+    return dir + "/" + name;
+  }
+
+  std::string m_dir, m_path, m_url;
+  std::map<std::string,std::vector<float> > m_axes;
+  std::map<std::string,float>               m_atts;
+  std::map<std::string,std::string>         m_text;
+  bool m_dirty, m_hit;
+};
+
+#endif
@@ -0,0 +1,234 @@
+/************************************************************/
+/*    FILE: hycom_ncss.h                                    */
+/************************************************************/
+
+// NetCDF Subset Service (NCSS) transport.
+//
+// DAP sends every packed value as 4 uncompressed bytes.  THREDDS' NCSS
+// endpoint returns the whole subset as one NetCDF-4 file, deflated on
+// the server, which is far smaller for land-heavy boxes (runs of
+// missing values compress to almost nothing).  NcssClient downloads a
+// subset to a temporary file; readSubset() then reads the requested
+// block from it like any local file.
+//
+// NCSS selects by coordinate values, not indices: lat/lon bounds with
+// one horizontal stride, a time range with a time stride, and either
+// one depth level or all of them.  The block is located in the
+// downloaded file by matching its first coordinate values.
+
+#ifndef HYCOM_NCSS_H
+#define HYCOM_NCSS_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <netcdf>
+#include "hycom_dap.h"
+#include "hycom_tiles.h"
+
+class NcssException : public std::runtime_error
+{
+ public:
+  NcssException(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// NCSS endpoint of a dodsC dataset URL, e.g.
+//   https://tds.hycom.org/thredds/dodsC/GLBv0.08/expt_93.0
+//   -> https://ncss.hycom.org/thredds/ncss/grid/GLBv0.08/expt_93.0
+inline std::string ncssURL(const std::string &url)
+{
+  std::string out = url;
+  size_t p = out.find("/dodsC/");
+  if (p != std::string::npos)
+    out.replace(p, 7, "/ncss/grid/");
+  p = out.find("://tds.hycom.org/");
+  if (p != std::string::npos)
+    out.replace(p, 17, "://ncss.hycom.org/");
+  return out;
+}
+
+// Hours since 2000-01-01 00:00:00 as ISO 8601, e.g. 2018-01-01T03:00:00Z
+inline std::string isoTime(double hours)
+{
+  long h = (long)floor(hours + 0.5);
+  long z = (long)floor(h/24.0) + 10957 + 719468; // days since 0000-03-01
+  long era = (z >= 0 ? z : z - 146096)/146097;
+  long doe = z - era*146097;
+  long yoe = (doe - doe/1460 + doe/36524 - doe/146096)/365;
+  long doy = doe - (365*yoe + yoe/4 - yoe/100);
+  long mp = (5*doy + 2)/153;
+  long d = doy - (153*mp + 2)/5 + 1;
+  long m = mp + (mp < 10 ? 3 : -9);
+  long y = yoe + era*400 + (m <= 2);
+  char iso[32];
+  snprintf(iso, sizeof(iso), "%04d-%02d-%02dT%02d:00:00Z",
+           (int)y, (int)m, (int)d, (int)(h - 24*(long)floor(h/24.0)));
+  return iso;
+}
+
+// One NCSS subset request
+struct NcssQuery
+{
+  std::vector<std::string> vars;
+  double south, north, west, east;  // degrees, inclusive
+  int    horiz_stride;
+  double t0, t1;                    // hours since 2000, inclusive
+  int    time_stride;
+  bool   all_levels;                // else only 'depth'
+  double depth;
+};
+
+class NcssClient
+{
+ public:
+  // tmp_dir: where subsets are downloaded
+  NcssClient(const std::string &tmp_dir)
+    : m_tmp_dir(tmp_dir), m_bytes(0), m_requests(0)
+  {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    m_curl = curl_easy_init();
+    if (!m_curl)
+      throw NcssException("NCSS: curl_easy_init failed");
+    dapConnection(m_curl);
+  }
+
+  ~NcssClient(){ curl_easy_cleanup(m_curl); }
+
+  // Download the subset of dataset 'url' (dodsC form); returns the path
+  // of a temporary file the caller must unlink
+  std::string download(const std::string &url, const NcssQuery &q)
+  {
+    std::string query = queryURL(url, q);
+    std::string path = m_tmp_dir + "/hycom_ncss_XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    int fd = mkstemp(&name[0]);
+    if (fd < 0)
+      throw NcssException("NCSS: cannot create temporary file in "
+                          + m_tmp_dir);
+    path = &name[0];
+    FILE *f = fdopen(fd, "wb");
+
+    curl_easy_setopt(m_curl, CURLOPT_URL, query.c_str());
+    curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, fwrite);
+    curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, f);
+    CURLcode res = curl_easy_perform(m_curl);
+    bool written = (fclose(f) == 0);
+    m_requests++;
+
+    long code = 0;
+    curl_off_t bytes = 0;
+    curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(m_curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    m_bytes += bytes;
+    if ((res != CURLE_OK) || (code != 200) || !written){
+      unlink(path.c_str());
+      std::ostringstream msg;
+      msg << "NCSS: request failed (" << curl_easy_strerror(res)
+          << ", HTTP " << code << ") [" << query << "]";
+      throw NcssException(msg.str());
+    }
+    return path;
+  }
+
+  double bytes()        const { return m_bytes; }
+  int    requestCount() const { return m_requests; }
+
+ private:
+  static std::string queryURL(const std::string &url, const NcssQuery &q)
+  {
+    std::ostringstream s;
+    s.precision(9);
+    s << ncssURL(url) << "?";
+    for (size_t v=0; v<q.vars.size(); v++)
+      s << "var=" << q.vars[v] << "&";
+    s << "north=" << q.north << "&south=" << q.south
+      << "&west=" << q.west << "&east=" << q.east
+      << "&horizStride=" << q.horiz_stride
+      << "&time_start=" << isoTime(q.t0) << "&time_end=" << isoTime(q.t1)
+      << "&timeStride=" << q.time_stride;
+    if (!q.all_levels)
+      s << "&vertCoord=" << q.depth;
+    s << "&accept=netcdf4";
+    return s.str();
+  }
+
+  std::string m_tmp_dir;
+  CURL       *m_curl;
+  double      m_bytes;
+  int         m_requests;
+};
+
+// Index of the value nearest to 'x' in axis 'name' of 'file'; with a
+// period (360 for longitude) values are compared modulo the period
+inline size_t nearestIndex(const netCDF::NcFile &file, const std::string &name,
+                           double x, double period = 0)
+{
+  netCDF::NcVar var = file.getVar(name);
+  if (var.isNull())
+    throw NcssException("NCSS: subset has no " + name + " axis");
+  std::vector<double> axis(var.getDim(0).getSize());
+  if (axis.empty())
+    throw NcssException("NCSS: subset has an empty " + name + " axis");
+  var.getVar(&axis[0]);
+  size_t best = 0;
+  double dbest = 1e30;
+  for (size_t i=0; i<axis.size(); i++){
+    double dx = fabs(axis[i] - x);
+    if (period > 0)
+      dx = std::min(fmod(dx, period), period - fmod(dx, period));
+    if (dx < dbest){
+      dbest = dx;
+      best = i;
+    }
+  }
+  return best;
+}
+
+// Read a block of 'count' points from a downloaded subset into the
+// cubes out[v] (extents 'cube') at 'dst'.  first[d] is the coordinate
+// value of the block's first point in [time][depth][lat][lon].
+inline void readSubset(const std::string &path,
+                       const std::vector<std::string> &names,
+                       const double *first, const size_t *count,
+                       const std::vector<size_t> &cube, const size_t *dst,
+                       const std::vector<short*> &out)
+{
+  netCDF::NcFile file(path, netCDF::NcFile::read);
+  static const char *axes[4] = {"time", "depth", "lat", "lon"};
+  std::vector<size_t> start(4), cnt(count, count+4);
+  for (int d=0; d<4; d++){
+    start[d] = nearestIndex(file, axes[d], first[d], (d == 3) ? 360 : 0);
+    size_t n = file.getVar(axes[d]).getDim(0).getSize();
+    if (start[d] + count[d] > n)
+      throw NcssException(std::string("NCSS: subset too small along ")
+                          + axes[d]);
+  }
+
+  FetchJob job;
+  for (int d=0; d<4; d++){
+    job.count[d] = count[d];
+    job.dst[d] = dst[d];
+  }
+  std::vector<short> tmp(count[0]*count[1]*count[2]*count[3]);
+  for (size_t v=0; v<names.size(); v++){
+    netCDF::NcVar var = file.getVar(names[v]);
+    if (var.isNull())
+      throw NcssException("NCSS: subset has no variable " + names[v]);
+    if (var.getType() != netCDF::ncShort)
+      throw NcssException("NCSS: " + names[v] + " is not packed;"
+                          " use --transport=dap");
+    var.getVar(start, cnt, &tmp[0]);
+    placeJob(job, &tmp[0], out[v], cube);
+  }
+}
+
+#endif
@@ -0,0 +1,96 @@
+/************************************************************/
+/*    FILE: hycom_packed.h                                  */
+/************************************************************/
+
+// Packed in-memory storage of the extracted cubes.
+//
+// Step 4.5 unpacks every 2-byte short into a 4-byte float as soon as
+// it arrives, doubling the memory of the result before anything reads
+// it.  PackedCube keeps the shorts as served, [rec][depth][lat][lon],
+// with the variable's packing (scale_factor, add_offset,
+// missing_value), and decodes only what is asked for: one value, one
+// depth slice or one record.  Decoding matches step 4.5 exactly:
+// value*scale + offset, and missing_value passed through unscaled.
+
+#ifndef HYCOM_PACKED_H
+#define HYCOM_PACKED_H
+
+#include <cstddef>
+#include "hycom_tensor.h"
+
+// Packing attributes of one variable
+struct Packing
+{
+  float scale, offset, missing;
+
+  float decode(short s) const
+  {
+    return (s != missing) ? (s * scale) + offset : missing;
+  }
+
+  // Same packed values mean the same decoded values
+  bool same(const Packing &p) const
+  {
+    return (scale == p.scale) && (offset == p.offset) &&
+      (missing == p.missing);
+  }
+};
+
+class PackedCube
+{
+ public:
+  PackedCube(size_t nrec, size_t nz, size_t ny, size_t nx,
+             const Packing &packing)
+    : m_packing(packing), m_values(nrec, nz, ny, nx) {}
+
+  // Raw shorts of record 't', [depth][lat][lon]
+  short* record(size_t t)
+  {
+    return m_values.data() + t*recordSize();
+  }
+  const short* record(size_t t) const
+  {
+    return m_values.data() + t*recordSize();
+  }
+
+  // Decoded value at [t][i][j][k]
+  float operator()(size_t t, size_t i, size_t j, size_t k) const
+  {
+    return m_packing.decode(m_values(t, i, j, k));
+  }
+
+  // Decode depth slice [t][i] (lat x lon values) into 'out'
+  void decodeSlice(size_t t, size_t i, float *out) const
+  {
+    size_t n = m_values.extent(2)*m_values.extent(3);
+    decode(record(t) + i*n, n, out);
+  }
+
+  // Decode record 't' (depth x lat x lon values) into 'out'
+  void decodeRecord(size_t t, float *out) const
+  {
+    decode(record(t), recordSize(), out);
+  }
+
+  const Packing& packing() const { return m_packing; }
+  size_t recordSize() const
+  {
+    return m_values.extent(1)*m_values.extent(2)*m_values.extent(3);
+  }
+  size_t records()    const { return m_values.extent(0); }
+  size_t bytes()      const { return m_values.size()*sizeof(short); }
+
+ private:
+  void decode(const short *src, size_t n, float *out) const
+  {
+    const Packing p = m_packing;
+    for (size_t v=0; v<n; v++)
+      out[v] = (src[v] != p.missing) ? (src[v] * p.scale) + p.offset
+                                     : p.missing;
+  }
+
+  Packing        m_packing;
+  Tensor4<short> m_values; // [rec][depth][lat][lon]
+};
+
+#endif
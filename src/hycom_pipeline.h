@@ -0,0 +1,150 @@
+/************************************************************/
+/*    FILE: hycom_pipeline.h                                */
+/************************************************************/
+
+// Prefetching read pipeline for the step 4.5 record loop.
+//
+// A background thread fills a ring of 'nslots' batch buffers while the
+// main thread unpacks the batch it already holds.  netcdf-c is not
+// thread-safe, so once the pipeline is running the fetch thread must be
+// the ONLY thread that touches the netCDF library; destroy (or join)
+// the pipeline before making any further netCDF calls.
+
+#ifndef HYCOM_PIPELINE_H
+#define HYCOM_PIPELINE_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <chrono>
+#include <cstddef>
+#include "hycom_buffers.h"
+
+// Wall clock in seconds, for stage timings
+inline double hycom_clock()
+{
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class BatchPipeline
+{
+ public:
+  // fetch(batch, buffers): fill one buffer per variable for 'batch'
+  typedef std::vector<short, AlignedAllocator<short> > Buffer;
+  typedef std::vector<Buffer> Buffers;
+  typedef std::function<void(int, Buffers&)> FetchFn;
+
+  BatchPipeline(int nbatch, int nslots, int nvars, size_t nvals,
+                FetchFn fetch)
+    : m_nbatch(nbatch), m_fetch(fetch), m_stop(false),
+      m_fetch_time(0), m_stall_time(0), m_wait_time(0)
+  {
+    if (nslots < 1)
+      nslots = 1;
+    m_slots.resize(nslots);
+    m_loaded.assign(nslots, -1);
+    for (int s=0; s<nslots; s++)
+      m_slots[s].assign(nvars, Buffer(nvals));
+
+    // A single slot means strictly serial reads: no thread at all
+    if (nslots > 1)
+      m_thread = std::thread(&BatchPipeline::run, this);
+  }
+
+  ~BatchPipeline(){ join(); }
+
+  // Block until 'batch' is loaded; its buffers stay valid until release()
+  Buffers& acquire(int batch)
+  {
+    int s = batch % m_slots.size();
+    if (!m_thread.joinable()){
+      double t0 = hycom_clock();
+      m_fetch(batch, m_slots[s]);
+      m_fetch_time += hycom_clock() - t0;
+      return m_slots[s];
+    }
+
+    double t0 = hycom_clock();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [&]{ return m_loaded[s]==batch || m_error; });
+    m_wait_time += hycom_clock() - t0;
+    if (m_error)
+      std::rethrow_exception(m_error);
+    return m_slots[s];
+  }
+
+  // Hand the buffers of 'batch' back to the fetch thread
+  void release(int batch)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_loaded[batch % m_slots.size()] = -1;
+    m_cond.notify_all();
+  }
+
+  void join()
+  {
+    if (!m_thread.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+      m_cond.notify_all();
+    }
+    m_thread.join();
+  }
+
+  // Stage timings [s]
+  double fetchTime() const { return m_fetch_time; } // reading
+  double stallTime() const { return m_stall_time; } // fetch waiting on slot
+  double waitTime()  const { return m_wait_time;  } // decode waiting on fetch
+  int    depth()     const { return m_slots.size(); }
+
+ private:
+  void run()
+  {
+    try{
+      for (int b=0; b<m_nbatch; b++){
+        int s = b % m_slots.size();
+        double t0 = hycom_clock();
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_cond.wait(lock, [&]{ return m_loaded[s]==-1 || m_stop; });
+          if (m_stop)
+            return;
+        }
+        double t1 = hycom_clock();
+        m_fetch(b, m_slots[s]);
+        double t2 = hycom_clock();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stall_time += t1 - t0;
+        m_fetch_time += t2 - t1;
+        m_loaded[s] = b;
+        m_cond.notify_all();
+      }
+    }
+    catch(...){
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_error = std::current_exception();
+      m_cond.notify_all();
+    }
+  }
+
+  int                     m_nbatch;
+  FetchFn                 m_fetch;
+  std::vector<Buffers>    m_slots;
+  std::vector<int>        m_loaded; // batch held by each slot, -1 = free
+  std::thread             m_thread;
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+  std::exception_ptr      m_error;
+  bool                    m_stop;
+
+  double m_fetch_time, m_stall_time, m_wait_time;
+};
+
+#endif
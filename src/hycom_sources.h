@@ -0,0 +1,127 @@
+/************************************************************/
+/*    FILE: hycom_sources.h                                 */
+/************************************************************/
+
+// Datasets of one extraction, opened on first use.
+//
+// FetchJob::src indexes this list.  A single-dataset run has one
+// source; a catalog run has one per experiment.  Each source gets its
+// own NcFile (and DAP client for combined reads) the first time a job
+// needs it.  attach() lends an NcFile the caller already has open.
+//
+// An aggregated directory can have hundreds of sources; with a bound
+// on open files the least recently used one is closed first.  A lent
+// file counts toward the bound but is never closed here, so with a
+// bound of 1 the other sources still get one file of their own.
+
+#ifndef HYCOM_SOURCES_H
+#define HYCOM_SOURCES_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <netcdf>
+#include "hycom_dap.h"
+
+class SourceSet
+{
+ public:
+  // max_open: bound on open files, lent ones included (0 = no bound)
+  SourceSet(const std::vector<std::string> &urls,
+            const std::vector<std::string> &names, int max_open = 0)
+    : m_urls(urls), m_names(names), m_files(urls.size(), NULL),
+      m_owned(urls.size()), m_vars(urls.size()), m_dap(urls.size()),
+      m_used(urls.size(), 0), m_max_open(max_open), m_open(0), m_clock(0),
+      m_opens(0) {}
+
+  // Use an NcFile the caller keeps open for source 'src'; sources
+  // sharing it count as one open file
+  void attach(int src, netCDF::NcFile &file)
+  {
+    if (std::find(m_files.begin(), m_files.end(), &file) == m_files.end())
+      m_open++;
+    m_files[src] = &file;
+  }
+
+  netCDF::NcFile& file(int src)
+  {
+    m_used[src] = ++m_clock;
+    if (!m_files[src]){
+      if ((m_max_open > 0) && (m_open >= m_max_open))
+        closeOldest();
+      m_owned[src].reset(new netCDF::NcFile(m_urls[src],
+                                            netCDF::NcFile::read));
+      m_files[src] = m_owned[src].get();
+      m_open++;
+      m_opens++;
+    }
+    return *m_files[src];
+  }
+
+  // Data variables of 'src', in the order of 'names'
+  std::vector<netCDF::NcVar>& vars(int src)
+  {
+    if (!m_files[src])
+      m_vars[src].clear(); // handles of a closed file
+    if (m_vars[src].empty())
+      for (size_t v=0; v<m_names.size(); v++){
+        netCDF::NcVar var = file(src).getVar(m_names[v]);
+        if (var.isNull())
+          throw std::runtime_error("no variable " + m_names[v] + " in "
+                                   + m_urls[src]);
+        m_vars[src].push_back(var);
+      }
+    return m_vars[src];
+  }
+
+  DapClient& dap(int src)
+  {
+    if (!m_dap[src])
+      m_dap[src].reset(new DapClient(m_urls[src]));
+    return *m_dap[src];
+  }
+
+  // Transfer counters of all DAP clients
+  DapStats dapStats() const
+  {
+    DapStats total;
+    for (size_t s=0; s<m_dap.size(); s++)
+      if (m_dap[s])
+        total += m_dap[s]->stats();
+    return total;
+  }
+
+  const std::string& url(int src) const { return m_urls[src]; }
+  int size() const { return m_urls.size(); }
+  int opens() const { return m_opens; }
+
+ private:
+  void closeOldest()
+  {
+    int oldest = -1;
+    for (size_t s=0; s<m_owned.size(); s++)
+      if (m_owned[s] && ((oldest < 0) || (m_used[s] < m_used[oldest])))
+        oldest = s;
+    if (oldest < 0)
+      return;
+    m_vars[oldest].clear();
+    m_files[oldest] = NULL;
+    m_owned[oldest].reset();
+    m_open--;
+  }
+
+  std::vector<std::string>                       m_urls;
+  std::vector<std::string>                       m_names;
+  std::vector<netCDF::NcFile*>                   m_files;
+  std::vector<std::unique_ptr<netCDF::NcFile> >  m_owned;
+  std::vector<std::vector<netCDF::NcVar> >       m_vars;
+  std::vector<std::unique_ptr<DapClient> >       m_dap;
+  std::vector<long>                              m_used;
+  int                                            m_max_open, m_open;
+  long                                           m_clock;
+  int                                            m_opens;
+};
+
+#endif
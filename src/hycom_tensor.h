@@ -0,0 +1,172 @@
+/************************************************************/
+/*    FILE: hycom_tensor.h                                  */
+/************************************************************/
+
+// 4D tensor [time][depth][lat][lon] with a compile-time memory layout.
+//
+// Tensor4 keeps its values in one contiguous, BUFFER_ALIGN-aligned
+// block and computes offsets inline, so an inner loop over one index
+// is a plain strided (or unit-stride) loop the compiler can vectorize;
+// boost::multi_array's chained [t][z][y][x] went through a proxy per
+// index.  The layout policy decides the order in memory:
+//   LayoutTZYX      : lon fastest, as the NetCDF files (the default)
+//   LayoutTYXZ      : depth fastest, whole profiles contiguous
+//   LayoutTiled<B>  : each depth level in BxB lat/lon tiles
+// Time is outermost in every layout, so a run of records is one
+// contiguous block and records() views it without a copy.
+// transpose() copies between layouts in cache-sized blocks.
+
+#ifndef HYCOM_TENSOR_H
+#define HYCOM_TENSOR_H
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+#include "hycom_buffers.h"
+
+struct LayoutTZYX
+{
+  static size_t size(const size_t *n) { return n[0]*n[1]*n[2]*n[3]; }
+  static size_t offset(const size_t *n, size_t t, size_t z, size_t y,
+                       size_t x)
+  {
+    return ((t*n[1] + z)*n[2] + y)*n[3] + x;
+  }
+};
+
+struct LayoutTYXZ
+{
+  static size_t size(const size_t *n) { return n[0]*n[1]*n[2]*n[3]; }
+  static size_t offset(const size_t *n, size_t t, size_t z, size_t y,
+                       size_t x)
+  {
+    return ((t*n[2] + y)*n[3] + x)*n[1] + z;
+  }
+};
+
+// Lat/lon tiles of B x B points, row-major within and across tiles;
+// edge tiles are padded to full size
+template <size_t B>
+struct LayoutTiled
+{
+  static size_t tiles(size_t n) { return (n + B - 1)/B; }
+  static size_t size(const size_t *n)
+  {
+    return n[0]*n[1]*tiles(n[2])*tiles(n[3])*B*B;
+  }
+  static size_t offset(const size_t *n, size_t t, size_t z, size_t y,
+                       size_t x)
+  {
+    size_t tile = ((t*n[1] + z)*tiles(n[2]) + y/B)*tiles(n[3]) + x/B;
+    return tile*B*B + (y%B)*B + x%B;
+  }
+};
+
+// Records [t0, t0+nt) of a tensor, indexed from 0; does not own data
+template <class T, class Layout = LayoutTZYX>
+class Tensor4View
+{
+ public:
+  Tensor4View(T *data, const size_t *n) : m_data(data)
+  {
+    std::copy(n, n+4, m_n);
+  }
+
+  T& operator()(size_t t, size_t z, size_t y, size_t x) const
+  {
+    return m_data[Layout::offset(m_n, t, z, y, x)];
+  }
+  T*     data() const { return m_data; }
+  size_t size() const { return Layout::size(m_n); }
+  size_t extent(int d) const { return m_n[d]; }
+
+ private:
+  T     *m_data;
+  size_t m_n[4];
+};
+
+template <class T, class Layout = LayoutTZYX>
+class Tensor4
+{
+ public:
+  typedef std::ptrdiff_t index;
+  typedef Layout layout;
+  typedef Tensor4View<T, Layout> View;
+
+  Tensor4(size_t nt, size_t nz, size_t ny, size_t nx)
+  {
+    m_n[0] = nt;
+    m_n[1] = nz;
+    m_n[2] = ny;
+    m_n[3] = nx;
+    m_data.resize(Layout::size(m_n));
+  }
+
+  T& operator()(size_t t, size_t z, size_t y, size_t x)
+  {
+    return m_data[Layout::offset(m_n, t, z, y, x)];
+  }
+  const T& operator()(size_t t, size_t z, size_t y, size_t x) const
+  {
+    return m_data[Layout::offset(m_n, t, z, y, x)];
+  }
+
+  // Records [t0, t0+nt) as a tensor of nt records
+  View records(size_t t0, size_t nt)
+  {
+    size_t n[4] = {nt, m_n[1], m_n[2], m_n[3]};
+    return View(m_data.data() + t0*recordSize(), n);
+  }
+
+  // Record 't' in [depth][lat][lon] order, as in the NetCDF files: in
+  // place with LayoutTZYX, otherwise copied into 'scratch' (one record)
+  const T* recordTZYX(size_t t, T *scratch) const
+  {
+    if (std::is_same<Layout, LayoutTZYX>::value)
+      return m_data.data() + t*recordSize();
+    for (size_t z=0, n=0; z<m_n[1]; z++)
+      for (size_t y=0; y<m_n[2]; y++)
+        for (size_t x=0; x<m_n[3]; x++, n++)
+          scratch[n] = (*this)(t, z, y, x);
+    return scratch;
+  }
+
+  T*       data()       { return m_data.data(); }
+  const T* data() const { return m_data.data(); }
+  size_t   size() const { return m_data.size(); }
+  size_t   extent(int d) const { return m_n[d]; }
+  size_t   recordSize() const { return m_n[0] ? m_data.size()/m_n[0] : 0; }
+
+ private:
+  size_t m_n[4];
+  std::vector<T, AlignedAllocator<T> > m_data;
+};
+
+// Points per side of the blocks transpose() copies at a time: 16^3
+// floats of source and destination stay within L1/L2
+static const size_t TENSOR_BLOCK = 16;
+
+// Copy 'src' into 'dst' (same extents, any layouts), block by block so
+// that both sides are walked within cache-sized neighbourhoods
+template <class T, class L1, class L2>
+void transpose(const Tensor4<T, L1> &src, Tensor4<T, L2> &dst)
+{
+  const size_t B = TENSOR_BLOCK;
+  size_t nt = src.extent(0), nz = src.extent(1);
+  size_t ny = src.extent(2), nx = src.extent(3);
+  for (size_t t=0; t<nt; t++)
+    for (size_t y0=0; y0<ny; y0+=B)
+      for (size_t z0=0; z0<nz; z0+=B)
+        for (size_t x0=0; x0<nx; x0+=B){
+          size_t y1 = std::min(y0+B, ny);
+          size_t z1 = std::min(z0+B, nz);
+          size_t x1 = std::min(x0+B, nx);
+          for (size_t y=y0; y<y1; y++)
+            for (size_t z=z0; z<z1; z++)
+              for (size_t x=x0; x<x1; x++)
+                dst(t, z, y, x) = src(t, z, y, x);
+        }
+}
+
+#endif
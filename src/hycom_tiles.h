@@ -0,0 +1,218 @@
+/************************************************************/
+/*    FILE: hycom_tiles.h                                   */
+/************************************************************/
+
+// Tile planner for large hyperslabs.
+//
+// A basin-scale box read as ONE slab per record is either refused by
+// THREDDS or served slowly.  planJobs() cuts the batch hyperslab
+// [time][depth][lat][lon] into FetchJobs whose payload stays under a
+// byte limit.  Spatial cuts fall on multiples of the tile size in
+// absolute grid indices, so the same tiles come back when a box is
+// moved or grown.  Each job records where its block goes in the batch
+// cube; placeJob() copies a fetched block into that position.
+//
+// With strides, counts and tile cuts are in points of the decimated
+// grid (source index start%stride + g*stride for grid index g).
+//
+// A longitude range that crosses the grid seam is given in unwrapped
+// indices (lon_size and up continue at 0).  The planner cuts at the
+// seam and wraps job.start[3], so both pieces are read with ordinary
+// hyperslabs and land in adjacent columns of the same batch cube.  A
+// range that starts past the seam (a cache hole east of it) is wrapped
+// as a whole.  normalizeLonBox() puts a requested box on the grid's
+// convention (-180:180 or 0:360) and tells whether it crosses the seam.
+
+#ifndef HYCOM_TILES_H
+#define HYCOM_TILES_H
+
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+// One hyperslab to read.  'var' indexes the variable list; -1 reads
+// every variable with one combined DAP request.  'src' indexes the
+// dataset list (see hycom_sources.h).
+struct FetchJob
+{
+  int    src;
+  int    var;
+  size_t start[4];  // source indices [time][depth][lat][lon]
+  size_t count[4];  // points per dimension
+  size_t stride[4]; // source index step between points
+  size_t dst[4];    // position of start[] in the batch cube
+};
+
+// Take both bounds of a lon box modulo 360 into [lon0, lon0+360), the
+// range of a grid whose first longitude is lon0 and last lon_last; a
+// box of 360 degrees or more is the whole grid.  true when the box then
+// crosses the seam (lon_min > lon_max, e.g. 170:-170 on -180:180).
+inline bool normalizeLonBox(float &lon_min, float &lon_max, float lon0,
+                            float lon_last)
+{
+  if (lon_max - lon_min >= 360){
+    lon_min = lon0;
+    lon_max = lon_last;
+    return false;
+  }
+  float *bound[2] = {&lon_min, &lon_max};
+  for (int b=0; b<2; b++){
+    float off = std::fmod(*bound[b] - lon0, 360.0f);
+    if (off < 0)
+      off += 360;
+    if (off >= 360)
+      off -= 360; // fmod of a tiny negative
+    *bound[b] = lon0 + off;
+  }
+  return lon_min > lon_max;
+}
+
+// Bytes per packed value on the wire: DAP2/XDR widens Int16 to 32 bits
+static const size_t WIRE_BYTES = 4;
+
+// Payload of 'job' on the wire; a combined job carries all 'nvars'
+inline double jobBytes(const FetchJob &job, int nvars)
+{
+  return (double)WIRE_BYTES*((job.var < 0) ? nvars : 1)*job.count[0]*
+    job.count[1]*job.count[2]*job.count[3];
+}
+
+// Cut points of [start, start+count) on the absolute grid of 'tile'
+inline std::vector<size_t> tileCuts(size_t start, size_t count,
+                                    size_t tile, bool aligned)
+{
+  std::vector<size_t> cuts;
+  cuts.push_back(start);
+  size_t c = aligned ? (start/tile + 1)*tile : start + tile;
+  for (; c < start+count; c += tile)
+    cuts.push_back(c);
+  cuts.push_back(start+count);
+  return cuts;
+}
+
+// Plan the jobs for one batch.
+//   start     : source indices of the first point
+//   count     : points per dimension, 'stride' source indices apart
+//   max_bytes : payload limit of a single request (0 = unlimited)
+//   min_jobs  : split further along time so parallel workers stay busy
+//   wrap      : source period of the lon dimension (0 = no wrapping)
+inline std::vector<FetchJob> planJobs(int nvars, bool combined,
+                                      const std::vector<size_t> &first,
+                                      const std::vector<size_t> &count,
+                                      const std::vector<size_t> &stride,
+                                      double max_bytes, int min_jobs,
+                                      size_t wrap = 0)
+{
+  std::vector<size_t> start = first;
+  if ((wrap > 0) && (start[3] >= wrap))
+    start[3] -= wrap; // wholly past the seam
+  int nv = combined ? 1 : nvars;
+  size_t vbytes = WIRE_BYTES*(combined ? nvars : 1);
+
+  // 1. Shrink the tile until one request fits the byte limit: time
+  //    first (keeps the spatial tiling stable), then the widest of
+  //    lon/lat/depth.
+  size_t tile[4];
+  for (int d=0; d<4; d++)
+    tile[d] = count[d];
+  while (max_bytes > 0){
+    double bytes = (double)vbytes*tile[0]*tile[1]*tile[2]*tile[3];
+    if (bytes <= max_bytes)
+      break;
+    int d = 0;
+    if (tile[0] == 1){
+      d = 3;
+      if (tile[2] > tile[d]) d = 2;
+      if (tile[1] > tile[d]) d = 1;
+      if (tile[d] == 1)
+        break; // a single value per request: nothing left to cut
+    }
+    tile[d] = (tile[d] + 1)/2;
+  }
+
+  // Grid index of start[] on each (strided) grid; time stays relative
+  size_t g0[4];
+  g0[0] = 0;
+  for (int d=1; d<4; d++)
+    g0[d] = start[d]/stride[d];
+
+  // 2. Enough jobs for the workers
+  while ((tile[0] > 1) && (min_jobs > 0)){
+    size_t njobs = nv*((count[0] + tile[0] - 1)/tile[0]);
+    for (int d=1; d<4; d++)
+      njobs *= tileCuts(g0[d], count[d], tile[d],
+                        tile[d] < count[d]).size() - 1;
+    if (njobs >= (size_t)min_jobs)
+      break;
+    tile[0] = (tile[0] + 1)/2;
+  }
+
+  // 3. Emit jobs: time relative to the batch, space on the grid
+  std::vector<size_t> cuts[4];
+  cuts[0] = tileCuts(0, count[0], tile[0], false);
+  for (int d=1; d<4; d++)
+    cuts[d] = tileCuts(g0[d], count[d], tile[d], tile[d] < count[d]);
+  if ((wrap > 0) && (start[3] + (count[3]-1)*stride[3] >= wrap)){
+    // first point past the seam
+    size_t seam = g0[3] + (wrap - start[3] + stride[3] - 1)/stride[3];
+    std::vector<size_t>::iterator c =
+      std::lower_bound(cuts[3].begin(), cuts[3].end(), seam);
+    if ((c != cuts[3].end()) && (*c != seam))
+      cuts[3].insert(c, seam);
+  }
+
+  std::vector<FetchJob> jobs;
+  for (int v=0; v<nv; v++)
+    for (size_t t=0; t+1<cuts[0].size(); t++)
+      for (size_t i=0; i+1<cuts[1].size(); i++)
+        for (size_t j=0; j+1<cuts[2].size(); j++)
+          for (size_t k=0; k+1<cuts[3].size(); k++){
+            size_t lo[4] = {cuts[0][t], cuts[1][i], cuts[2][j], cuts[3][k]};
+            size_t hi[4] = {cuts[0][t+1], cuts[1][i+1],
+                            cuts[2][j+1], cuts[3][k+1]};
+            FetchJob job;
+            job.src = 0;
+            job.var = combined ? -1 : v;
+            for (int d=0; d<4; d++){
+              job.count[d]  = hi[d] - lo[d];
+              job.dst[d]    = lo[d] - g0[d];
+              job.start[d]  = start[d] + (lo[d] - g0[d])*stride[d];
+              job.stride[d] = stride[d];
+            }
+            if ((wrap > 0) && (job.start[3] >= wrap))
+              job.start[3] -= wrap;
+            jobs.push_back(job);
+          }
+  return jobs;
+}
+
+// Copy a contiguous job-shaped block into a cube of extents 'cube'
+inline void placeJob(const FetchJob &job, const short *src, short *dst,
+                     const std::vector<size_t> &cube)
+{
+  for (size_t t=0; t<job.count[0]; t++)
+    for (size_t i=0; i<job.count[1]; i++)
+      for (size_t j=0; j<job.count[2]; j++){
+        size_t off = (((job.dst[0]+t)*cube[1] + job.dst[1]+i)*cube[2]
+                      + job.dst[2]+j)*cube[3] + job.dst[3];
+        memcpy(dst + off, src, job.count[3]*sizeof(short));
+        src += job.count[3];
+      }
+}
+
+// Set the block of 'job' in a cube of extents 'cube' to 'value'
+inline void fillJob(const FetchJob &job, short value, short *dst,
+                    const std::vector<size_t> &cube)
+{
+  for (size_t t=0; t<job.count[0]; t++)
+    for (size_t i=0; i<job.count[1]; i++)
+      for (size_t j=0; j<job.count[2]; j++){
+        size_t off = (((job.dst[0]+t)*cube[1] + job.dst[1]+i)*cube[2]
+                      + job.dst[2]+j)*cube[3] + job.dst[3];
+        std::fill(dst + off, dst + off + job.count[3], value);
+      }
+}
+
+#endif
@@ -0,0 +1,118 @@
+/************************************************************/
+/*    FILE: hycom_tuner.h                                   */
+/************************************************************/
+
+// Adaptive request size and concurrency (AIMD).
+//
+// The best tile size and number of requests in flight depend on the
+// server's load that day.  FetchTuner is fed the bytes and wall time of
+// each batch fetch and steers both knobs to maximize throughput:
+//   - while throughput holds, one knob grows additively (the two knobs
+//     take turns: tile += step, then in-flight += 1);
+//   - when throughput falls by more than 5%, the knob grown last is
+//     cut multiplicatively (x0.7);
+//   - a failed (or timed out) fetch halves both.
+// The tile never drops below TUNER_MIN_TILE, or below the initial tile
+// when that is smaller (an explicit small --tile-bytes).
+// The settings of the fastest batch are reported as command line
+// flags, so a later run can start from them.
+
+#ifndef HYCOM_TUNER_H
+#define HYCOM_TUNER_H
+
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+static const double TUNER_MIN_TILE = 1048576;        // 1 MB
+static const double TUNER_MAX_TILE = 1024*1048576.0; // 1 GB
+
+class FetchTuner
+{
+ public:
+  // tile_bytes: initial request payload limit; inflight: initial and
+  // max_inflight: largest number of concurrent requests
+  FetchTuner(double tile_bytes, int inflight, int max_inflight)
+    : m_min_tile(std::min(tile_bytes, TUNER_MIN_TILE)),
+      m_tile(clampTile(tile_bytes)), m_step(std::max(m_tile/4, m_min_tile)),
+      m_inflight(std::max(1, std::min(inflight, max_inflight))),
+      m_max_inflight(std::max(1, max_inflight)), m_grew(TILE), m_last(0),
+      m_best(0), m_best_tile(m_tile), m_best_inflight(m_inflight),
+      m_batches(0), m_failures(0), m_latency(0) {}
+
+  // A batch moved 'bytes' in 'seconds' with 'requests' requests
+  void success(double bytes, double seconds, int requests)
+  {
+    if ((seconds <= 0) || (requests <= 0))
+      return; // served from cache, nothing learned
+    double rate = bytes/seconds;
+    m_latency = seconds*std::min(requests, m_inflight)/requests;
+    m_batches++;
+    if (rate > m_best){
+      m_best = rate;
+      m_best_tile = m_tile;
+      m_best_inflight = m_inflight;
+    }
+
+    if ((m_last > 0) && (rate < 0.95*m_last)){
+      if (m_grew == TILE)
+        m_tile = clampTile(0.7*m_tile);
+      else
+        m_inflight = std::max(1, (int)(0.7*m_inflight));
+    }
+    else if ((m_grew == TILE) && (m_inflight < m_max_inflight)){
+      m_inflight++;
+      m_grew = INFLIGHT;
+    }
+    else{
+      m_tile = clampTile(m_tile + m_step);
+      m_grew = TILE;
+    }
+    m_last = rate;
+  }
+
+  // A batch fetch failed or timed out
+  void failure()
+  {
+    m_failures++;
+    m_tile = clampTile(0.5*m_tile);
+    m_inflight = std::max(1, m_inflight/2);
+    m_last = 0;
+  }
+
+  double tileBytes() const { return m_tile; }
+  int    inflight()  const { return m_inflight; }
+  double lastRate()  const { return m_last; }    // bytes/s
+  double bestRate()  const { return m_best; }    // bytes/s
+  double latency()   const { return m_latency; } // s per request
+  int    batches()   const { return m_batches; }
+  int    failures()  const { return m_failures; }
+
+  // Flags reproducing the fastest settings seen
+  std::string flags() const
+  {
+    std::ostringstream s;
+    s << "--tile-bytes=" << m_best_tile/1048576;
+    if (m_max_inflight > 1)
+      s << " --workers=" << m_best_inflight;
+    return s.str();
+  }
+
+ private:
+  enum Knob { TILE, INFLIGHT };
+
+  double clampTile(double bytes) const
+  {
+    return std::max(m_min_tile, std::min(bytes, TUNER_MAX_TILE));
+  }
+
+  double m_min_tile, m_tile, m_step;
+  int    m_inflight, m_max_inflight;
+  Knob   m_grew;
+  double m_last, m_best, m_best_tile;
+  int    m_best_inflight;
+  int    m_batches, m_failures;
+  double m_latency;
+};
+
+#endif
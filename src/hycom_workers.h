@@ -0,0 +1,292 @@
+/************************************************************/
+/*    FILE: hycom_workers.h                                 */
+/************************************************************/
+
+// Multi-process fetch workers for remote hyperslabs.
+//
+// netcdf-c is not thread-safe, so parallel reads need separate
+// processes.  FetchPool forks K workers, each with its own NcFile
+// connection per dataset.  The parent hands out FetchJobs (variable, time range,
+// tile) over a pipe; workers write the packed shorts straight into a
+// shared memory cube [rec][depth][lat][lon] per variable and report
+// back on a common result pipe, along with their DAP transfer counters.
+//
+// Create the pool BEFORE starting any threads: fork() only clones the
+// calling thread.  A worker that dies is dropped from the pool (its job
+// fails, the batch throws) and the remaining workers carry on; the pool
+// ignores SIGPIPE so a write to a dead worker is an error, not a kill.
+
+#ifndef HYCOM_WORKERS_H
+#define HYCOM_WORKERS_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cstddef>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <netcdf>
+#include "hycom_dap.h"
+#include "hycom_tiles.h"
+#include "hycom_sources.h"
+
+class FetchException : public std::runtime_error
+{
+ public:
+  FetchException(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// Read one job into the batch cubes out[v] (extents 'cube').  A
+// combined DAP request (var == -1) decodes straight into the cubes;
+// netCDF reads go through 'tmp', scratch space reused between calls.
+inline void readJob(const FetchJob &job, SourceSet &sources,
+                    const std::vector<std::string> &names,
+                    const std::vector<size_t> &cube,
+                    const std::vector<short*> &out, std::vector<short> &tmp)
+{
+  std::vector<size_t> start(job.start, job.start+4);
+  std::vector<size_t> count(job.count, job.count+4);
+  std::vector<size_t> stride(job.stride, job.stride+4);
+
+  if (job.var < 0){
+    sources.dap(job.src).getVarsInto(names, start, count, stride, out,
+                                     cube, job.dst);
+    return;
+  }
+  tmp.resize(count[0]*count[1]*count[2]*count[3]);
+  std::vector<ptrdiff_t> step(stride.begin(), stride.end());
+  sources.vars(job.src)[job.var].getVar(start, count, step, &tmp[0]);
+  placeJob(job, &tmp[0], out[job.var], cube);
+}
+
+class FetchPool
+{
+ public:
+  // urls     : datasets indexed by FetchJob::src
+  // cube     : extents of the shared buffer of EACH variable
+  // max_open : open files per worker (0 = no bound)
+  FetchPool(const std::vector<std::string> &urls,
+            const std::vector<std::string> &names,
+            const std::vector<size_t> &cube, int nworkers, int max_open = 0)
+    : m_urls(urls), m_names(names), m_cube(cube), m_max_open(max_open),
+      m_jobs(0)
+  {
+    m_nvals = 1;
+    for (size_t d=0; d<cube.size(); d++)
+      m_nvals *= cube[d];
+    m_bytes = names.size()*m_nvals*sizeof(short);
+    void *mem = mmap(NULL, m_bytes, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      throw FetchException("FetchPool: cannot map shared memory");
+    m_shared = (short*)mem;
+
+    if (pipe(m_result) != 0)
+      throw FetchException("FetchPool: cannot create result pipe");
+    signal(SIGPIPE, SIG_IGN); // parent and workers alike
+
+    std::cout.flush(); // keep buffered output out of the children
+    for (int w=0; w<nworkers; w++){
+      int fd[2];
+      if (pipe(fd) != 0)
+        throw FetchException("FetchPool: cannot create job pipe");
+      pid_t pid = fork();
+      if (pid < 0)
+        throw FetchException("FetchPool: fork failed");
+      if (pid == 0){
+        close(fd[1]);
+        close(m_result[0]);
+        for (size_t i=0; i<m_jobfd.size(); i++)
+          close(m_jobfd[i]);
+        _exit(worker(w, fd[0], m_result[1]));
+      }
+      close(fd[0]);
+      m_pid.push_back(pid);
+      m_alive.push_back(true);
+      m_dap.push_back(DapStats());
+      m_jobfd.push_back(fd[1]);
+    }
+    close(m_result[1]);
+  }
+
+  ~FetchPool()
+  {
+    for (size_t w=0; w<m_jobfd.size(); w++)
+      close(m_jobfd[w]); // EOF tells the worker to exit
+    for (size_t w=0; w<m_pid.size(); w++)
+      if (m_alive[w])
+        waitpid(m_pid[w], NULL, 0);
+    close(m_result[0]);
+    munmap(m_shared, m_bytes);
+  }
+
+  // Run all jobs on the live workers, at most one per worker at a time
+  // and at most 'inflight' in total (0 = one per worker); blocks until
+  // done
+  void run(const std::vector<FetchJob> &jobs, int inflight = 0)
+  {
+    std::vector<bool> busy(m_pid.size(), false);
+    size_t next = 0, done = 0;
+    int nbusy = 0;
+    std::string error;
+    if ((inflight <= 0) || (inflight > (int)m_pid.size()))
+      inflight = m_pid.size();
+
+    while (done < jobs.size()){
+      for (size_t w=0; (w<busy.size()) && (next<jobs.size()); w++){
+        if (!m_alive[w] || busy[w] || !error.empty() || (nbusy >= inflight))
+          continue;
+        if (write(m_jobfd[w], &jobs[next], sizeof(FetchJob))
+            != sizeof(FetchJob)){
+          reap(w);
+          error = "worker pipe closed";
+          continue;
+        }
+        busy[w] = true;
+        nbusy++;
+        next++;
+      }
+      if (nbusy == 0){
+        if (error.empty())
+          error = "no workers left";
+        break;
+      }
+
+      Result res;
+      readResult(res, busy);
+      busy[res.worker] = false;
+      nbusy--;
+      m_dap[res.worker] = res.dap;
+      done++;
+      m_jobs++;
+      if (res.status != 0)
+        error = res.message;
+    }
+    if (!error.empty())
+      throw FetchException("FetchPool: " + error);
+  }
+
+  // Shared cube of variable 'v'
+  short* buffer(int v) { return m_shared + v*m_nvals; }
+  int    workerCount() const { return m_pid.size(); }
+  int    liveCount() const
+  {
+    return std::count(m_alive.begin(), m_alive.end(), true);
+  }
+  int    jobCount() const { return m_jobs; }
+
+  // DAP transfer counters summed over the workers
+  DapStats dapStats() const
+  {
+    DapStats total;
+    for (size_t w=0; w<m_dap.size(); w++)
+      total += m_dap[w];
+    return total;
+  }
+
+ private:
+  struct Result {
+    int  worker;
+    int  status;
+    DapStats dap;      // the worker's totals so far
+    char message[256];
+  };
+
+  // Next result; a busy worker that died yields a failed result of
+  // its own, an idle one is just dropped
+  void readResult(Result &res, const std::vector<bool> &busy)
+  {
+    while (true){
+      struct pollfd pfd;
+      pfd.fd = m_result[0];
+      pfd.events = POLLIN;
+      int ready = poll(&pfd, 1, 1000);
+      if (ready > 0){
+        if (read(m_result[0], &res, sizeof(Result)) == sizeof(Result))
+          return;
+        throw FetchException("FetchPool: result pipe closed");
+      }
+      // nothing yet: make sure no worker died mid-job
+      for (size_t w=0; w<m_pid.size(); w++){
+        if (!m_alive[w] || (waitpid(m_pid[w], NULL, WNOHANG) != m_pid[w]))
+          continue;
+        m_alive[w] = false;
+        close(m_jobfd[w]);
+        m_jobfd[w] = -1;
+        if (!busy[w])
+          continue;
+        res.worker = w;
+        res.status = 1;
+        res.dap = m_dap[w];
+        strcpy(res.message, "worker exited unexpectedly");
+        return;
+      }
+    }
+  }
+
+  // Drop worker 'w' (its job pipe is broken)
+  void reap(size_t w)
+  {
+    kill(m_pid[w], SIGKILL);
+    waitpid(m_pid[w], NULL, 0);
+    m_alive[w] = false;
+    close(m_jobfd[w]);
+    m_jobfd[w] = -1;
+  }
+
+  int worker(int w, int jobfd, int resultfd)
+  {
+    try{
+      SourceSet sources(m_urls, m_names, m_max_open);
+
+      std::vector<short*> out;
+      for (size_t v=0; v<m_names.size(); v++)
+        out.push_back(buffer(v));
+
+      FetchJob job;
+      std::vector<short> tmp;
+      while (read(jobfd, &job, sizeof(FetchJob)) == sizeof(FetchJob)){
+        Result res;
+        res.worker = w;
+        res.status = 0;
+        res.message[0] = '\0';
+        try{
+          readJob(job, sources, m_names, m_cube, out, tmp);
+        }
+        catch(std::exception &e){
+          res.status = 1;
+          strncpy(res.message, e.what(), sizeof(res.message)-1);
+          res.message[sizeof(res.message)-1] = '\0';
+        }
+        res.dap = sources.dapStats();
+        if (write(resultfd, &res, sizeof(Result)) != sizeof(Result))
+          return 1;
+      }
+    }
+    catch(...){
+      return 1;
+    }
+    return 0;
+  }
+
+  std::vector<std::string> m_urls;
+  std::vector<std::string> m_names;
+  std::vector<size_t>      m_cube;
+  int                      m_max_open;
+  size_t                   m_nvals, m_bytes;
+  short                   *m_shared;
+  int                      m_result[2];
+  std::vector<pid_t>       m_pid;
+  std::vector<bool>        m_alive;
+  std::vector<int>         m_jobfd;
+  std::vector<DapStats>    m_dap;
+  int                      m_jobs;
+};
+
+#endif
@@ -9,8 +9,26 @@
 #include <cstdlib>
 #include <string>
 #include <sstream>
+#include <memory>
+#include <mutex>
+#include <functional>
 #include <netcdf>
-#include "boost/multi_array.hpp"
+#include "hycom_pipeline.h"
+#include "hycom_dap.h"
+#include "hycom_tiles.h"
+#include "hycom_workers.h"
+#include "hycom_cache.h"
+#include "hycom_meta.h"
+#include "hycom_axis.h"
+#include "hycom_catalog.h"
+#include "hycom_sources.h"
+#include "hycom_aggregate.h"
+#include "hycom_ncss.h"
+#include "hycom_tuner.h"
+#include "hycom_land.h"
+#include "hycom_buffers.h"
+#include "hycom_packed.h"
+#include "hycom_tensor.h"
 
 using namespace std;
 using namespace netCDF;
@@ -37,8 +55,47 @@ static const int NC_ERR = 2;
 
 int main(int argc, char **argv){
 
+  // Options needed before the dataset is opened
+  string meta_dir = "";             // axis/attribute cache, "" = off
+  float meta_ttl = 24;              // axis/attribute cache lifetime [h]
+  bool lazy_time = false;           // binary-search the remote time axis
+  bool verbose = false;             // list all variables and dimensions
+  string source = "";               // dataset path or URL, "" = dataURL
+  string agg_dir = "";              // directory of per-day files
+  int max_open = 64;                // open file bound (aggregation)
+
   for (int i=1; i<argc; i++){
     string argi_prerun = argv[i];
+    if(argi_prerun.find("--meta-cache=") == 0){
+      meta_dir = argi_prerun.substr(13);
+      if (meta_dir == "off")
+        meta_dir = "";
+      continue;
+    }
+    if(argi_prerun.find("--meta-ttl=") == 0){
+      meta_ttl = atof(argi_prerun.substr(11).c_str());
+      continue;
+    }
+    if(argi_prerun.find("--lazy-time=") == 0){
+      lazy_time = (argi_prerun.substr(12) == "true");
+      continue;
+    }
+    if(argi_prerun == "--verbose"){
+      verbose = true;
+      continue;
+    }
+    if(argi_prerun.find("--source=") == 0){
+      source = argi_prerun.substr(9);
+      continue;
+    }
+    if(argi_prerun.find("--aggregate=") == 0){
+      agg_dir = argi_prerun.substr(12);
+      continue;
+    }
+    if(argi_prerun.find("--max-open=") == 0){
+      max_open = atoi(argi_prerun.substr(11).c_str());
+      continue;
+    }
     if((argi_prerun.find("-h")==0)||(argi_prerun.find("--help")==0)){
       cout <<"\n  SUMMARY: This program is used to extract data from\n"
            <<"           HYCOM NetCDF files.\n"
@@ -54,7 +111,34 @@ int main(int argc, char **argv){
            <<"  --latmax=[FLOAT]   : latitude: northern edge\n"
            <<"  --lonmin=[FLOAT]   : longitude: western edge\n"
            <<"  --lonmax=[FLOAT]   : longitude: eastern edge\n"
-           <<"  --newfile=true     : write new netCDF file\n" << endl;
+           <<"  --newfile=true     : write new netCDF file\n"
+           <<"  --stream=true      : write each batch as it is read\n"
+           <<"  --packed=true      : keep values packed, decode on use\n"
+           <<"  --records-per-read=[INT|auto] : time records per hyperslab read\n"
+           <<"  --read-budget=[FLOAT]         : read buffer budget [MB] (auto)\n"
+           <<"  --prefetch=[INT]              : read buffers in flight (1=serial)\n"
+           <<"  --combined=true               : one DAP request for all variables\n"
+           <<"  --workers=[INT]               : parallel fetch processes\n"
+           <<"  --tile-bytes=[FLOAT]          : max payload per request [MB]\n"
+           <<"  --cache=[DIR]                 : on-disk tile cache directory\n"
+           <<"  --cache-size=[FLOAT]          : tile cache size cap [MB]\n"
+           <<"  --depth-stride=[INT]          : keep every n-th depth level\n"
+           <<"  --lat-stride=[INT]            : keep every n-th latitude\n"
+           <<"  --lon-stride=[INT]            : keep every n-th longitude\n"
+           <<"  --time-stride=[INT]           : keep every n-th time record\n"
+           <<"  --catalog=[builtin|FILE]      : span experiments by date range\n"
+           <<"  --transport=[dap|ncss|auto]   : data transport (auto: by size)\n"
+           <<"  --ncss-threshold=[FLOAT]      : auto: NCSS above this payload [MB]\n"
+           <<"  --autotune=true               : adapt tile size and concurrency\n"
+           <<"  --skip-land=true              : learn land tiles and skip them\n"
+           <<"  --meta-cache=[DIR|off]        : axis/attribute cache (default off)\n"
+           <<"  --meta-ttl=[FLOAT]            : axis/attribute cache lifetime [h]\n"
+           <<"  --lazy-time=true              : search time axis remotely\n"
+           <<"  --verbose                     : list dataset variables/dimensions\n"
+           <<"  --source=[PATH|URL]           : dataset to read (local mirror)\n"
+           <<"  --aggregate=[DIR]             : read a directory of per-day files\n"
+           <<"  --max-open=[INT]              : open file bound (aggregation)\n"
+           << endl;
 
     cout << "  NOTE: If no input is detected on command line\n"
          << "        User will be prompted to specify bounds.\n" << endl;
@@ -71,6 +155,26 @@ int main(int argc, char **argv){
     //string dataURL = "https://tds.hycom.org/thredds/dodsC/GLBv0.08/expt_57.2";
     //string dataURL = "https://tds.hycom.org/thredds/dodsC/GLBv0.08/expt_53.X/data/2013";
     //NcFile dataFile(dataURL, NcFile::read, NcFile::classic);
+    if (!source.empty() && !agg_dir.empty()){
+      cout << "(!) --source AND --aggregate CANNOT BE COMBINED" << endl;
+      return NC_ERR;
+    }
+    if (!source.empty())
+      dataURL = source; // e.g. a local mirror of the remote dataset
+
+    // Aggregation: the per-day files of a local directory form one
+    // virtual dataset; the earliest file supplies axes and attributes.
+    DirectoryIndex aggIndex;
+    if (!agg_dir.empty()){
+      if (!aggIndex.scan(agg_dir, meta_dir)){
+        cout << "(!) NO NETCDF FILES WITH A TIME AXIS IN " << agg_dir << endl;
+        return NC_ERR;
+      }
+      dataURL = aggIndex.file(aggIndex.files()[0].name);
+      cout << "AGGREGATION: " << aggIndex.files().size() << " files in "
+           << agg_dir << " (" << aggIndex.opened() << " opened to index)"
+           << endl;
+    }
     NcFile dataFile(dataURL, NcFile::read);
 
     //---------------------------------------------------------------
@@ -84,21 +188,23 @@ int main(int argc, char **argv){
     cout << "  " << dataFile.getGroupCount() << " groups"     << endl;
     cout << "  " << dataFile.getTypeCount()  << " types\n"    << endl;
 
-    cout << "-----------------------\n";
-    cout << "VARIABLES:" << endl;
-    multimap<string,NcVar> varMap = dataFile.getVars();
-    for (multimap<string,NcVar>::iterator it=varMap.begin();
-         it!=varMap.end(); ++it)
-      cout << "  " << (*it).first << endl;
-    cout << endl;
-
-    cout << "-----------------------\n";
-    cout << "DIMENSIONS:" << endl;
-    multimap<string,NcDim> dimMap = dataFile.getDims();
-    for (multimap<string,NcDim>::iterator it=dimMap.begin();
-         it!=dimMap.end(); ++it)
-      cout << "  " << (*it).first << endl;
-    cout << endl;
+    if (verbose){
+      cout << "-----------------------\n";
+      cout << "VARIABLES:" << endl;
+      multimap<string,NcVar> varMap = dataFile.getVars();
+      for (multimap<string,NcVar>::iterator it=varMap.begin();
+           it!=varMap.end(); ++it)
+        cout << "  " << (*it).first << endl;
+      cout << endl;
+
+      cout << "-----------------------\n";
+      cout << "DIMENSIONS:" << endl;
+      multimap<string,NcDim> dimMap = dataFile.getDims();
+      for (multimap<string,NcDim>::iterator it=dimMap.begin();
+           it!=dimMap.end(); ++it)
+        cout << "  " << (*it).first << endl;
+      cout << endl;
+    }
 
     //---------------------------------------------------------------
     // 3. READ & INSPECT INDEPENDENT (DIMENSION) VARIABLES
@@ -106,6 +212,12 @@ int main(int argc, char **argv){
     NcVar depthVar, latVar, lonVar, timeVar;
     NcDim depthDim, latDim, lonDim, timeDim;
 
+    // Axes and attributes come from the local metadata cache while it
+    // is fresh and its axis lengths match the server's dimensions.
+    DatasetMeta meta;
+    meta.load(meta_dir, dataURL, meta_ttl);
+    meta.check(dataFile);
+
     cout << "-----------------------\n";
     cout << "DIMENSION SIZES:" << endl;
     // 3.1: Depth
@@ -114,8 +226,8 @@ int main(int argc, char **argv){
       return NC_ERR;
     depthDim = depthVar.getDim(0);
     int depth_size = depthDim.getSize();
-    float DEPTH[depth_size];
-    depthVar.getVar(DEPTH);
+    AlignedBuffer<float> DEPTH(depth_size);
+    meta.axis(depthVar, DEPTH, depth_size);
     cout << "  depth = " << DEPTH[0] << ":" << DEPTH[depth_size-1]
          << "        [n=" << depth_size << "]" << endl;
 
@@ -125,8 +237,8 @@ int main(int argc, char **argv){
       return NC_ERR;
     latDim = latVar.getDim(0);
     int lat_size = latDim.getSize();
-    float LAT[lat_size];
-    latVar.getVar(LAT);
+    AlignedBuffer<float> LAT(lat_size);
+    meta.axis(latVar, LAT, lat_size);
     cout << "  lat   = " << LAT[0] << ":" << LAT[lat_size-1]
          << "        [n=" << lat_size << "]" << endl;
     
@@ -136,8 +248,8 @@ int main(int argc, char **argv){
       return NC_ERR;
     lonDim = lonVar.getDim(0);
     int lon_size = lonDim.getSize();
-    float LON[lon_size];
-    lonVar.getVar(LON);
+    AlignedBuffer<float> LON(lon_size);
+    meta.axis(lonVar, LON, lon_size);
     cout << "  lon   = " << LON[0] << ":" << LON[lon_size-1]
          << "      [n=" << lon_size << "]" << endl;
 
@@ -147,8 +259,16 @@ int main(int argc, char **argv){
       return NC_ERR;
     timeDim = timeVar.getDim(0);
     int time_size = timeDim.getSize();
-    float TIME[time_size];
-    timeVar.getVar(TIME);
+    AlignedBuffer<float> TIME(time_size);
+    // Lazy mode leaves TIME unfilled; entries are read one at a time by
+    // the index search (4.1.4) and the selected range in one request.
+    LazyAxis timeAxis(timeVar, TIME, time_size);
+    if (!lazy_time || meta.hasAxis("time")){
+      meta.axis(timeVar, TIME, time_size);
+      timeAxis.setKnown();
+    }
+    timeAxis.at(0);
+    timeAxis.at(time_size-1);
     cout << "  time  = " << TIME[0] << ":" << TIME[time_size-1]
          << " [n=" << time_size << "]" << endl;
     cout << endl;
@@ -167,7 +287,26 @@ int main(int argc, char **argv){
     float lat_min, lat_max;
     float lon_min, lon_max;
     bool newfile = false;
+    bool stream = false;         // write batches as read, not held in memory
+    bool packed = false;         // hold packed shorts, not floats
     string newfile_response = "";
+    int records_per_read = 1;    // time records per hyperslab read
+    float read_budget_mb = 16;   // read buffer budget, used when 'auto'
+    int prefetch_depth = 2;      // batch buffers in the read pipeline
+    bool combined = false;       // one DAP request per hyperslab
+    int nworkers = 0;            // fetch processes, 0 = read in-process
+    float tile_mb = 64;          // request payload limit, 0 = no tiling
+    string cache_dir = "";       // tile cache, "" = disabled
+    float cache_mb = 4096;       // tile cache size cap
+    int depth_stride = 1;        // read every n-th depth level
+    int lat_stride = 1;          // read every n-th latitude
+    int lon_stride = 1;          // read every n-th longitude
+    int time_stride = 1;         // read every n-th time record
+    string catalog = "";         // experiment catalog, "" = dataURL only
+    string transport = "dap";    // dap, ncss or auto (by estimated bytes)
+    float ncss_mb = 64;          // auto: NCSS for runs above this DAP payload
+    bool autotune = false;       // adapt tile size and requests in flight
+    bool skip_land = false;      // skip tiles the land index knows are land
     int nparams = 0;
     for (int i=1; i<argc; i++){
       string input, subinput;
@@ -230,6 +369,80 @@ int main(int argc, char **argv){
       else if(argi.find("--newfile=false") == 0){
         newfile=false;
       }
+      else if(argi.find("--stream=true") == 0){
+        stream=true;
+      }
+      else if(argi.find("--packed=true") == 0){
+        packed=true;
+      }
+      else if(argi.find("--records-per-read=") == 0){
+        input = argi.substr(19);
+        if (input == "auto")
+          records_per_read = 0; // resolved from read budget in (4.2)
+        else
+          records_per_read = atoi(input.c_str());
+      }
+      else if(argi.find("--read-budget=") == 0){
+        input = argi.substr(14);
+        read_budget_mb = atof(input.c_str());
+      }
+      else if(argi.find("--prefetch=") == 0){
+        input = argi.substr(11);
+        prefetch_depth = atoi(input.c_str());
+      }
+      else if(argi.find("--combined=true") == 0){
+        combined=true;
+      }
+      else if(argi.find("--combined=false") == 0){
+        combined=false;
+      }
+      else if(argi.find("--workers=") == 0){
+        input = argi.substr(10);
+        nworkers = atoi(input.c_str());
+      }
+      else if(argi.find("--tile-bytes=") == 0){
+        input = argi.substr(13);
+        tile_mb = atof(input.c_str());
+      }
+      else if(argi.find("--cache=") == 0){
+        cache_dir = argi.substr(8);
+      }
+      else if(argi.find("--cache-size=") == 0){
+        input = argi.substr(13);
+        cache_mb = atof(input.c_str());
+      }
+      else if(argi.find("--depth-stride=") == 0){
+        input = argi.substr(15);
+        depth_stride = max(atoi(input.c_str()), 1);
+      }
+      else if(argi.find("--lat-stride=") == 0){
+        input = argi.substr(13);
+        lat_stride = max(atoi(input.c_str()), 1);
+      }
+      else if(argi.find("--lon-stride=") == 0){
+        input = argi.substr(13);
+        lon_stride = max(atoi(input.c_str()), 1);
+      }
+      else if(argi.find("--time-stride=") == 0){
+        input = argi.substr(14);
+        time_stride = max(atoi(input.c_str()), 1);
+      }
+      else if(argi.find("--catalog=") == 0){
+        catalog = argi.substr(10);
+      }
+      else if(argi.find("--transport=") == 0){
+        transport = argi.substr(12);
+      }
+      else if(argi.find("--ncss-threshold=") == 0){
+        input = argi.substr(17);
+        ncss_mb = atof(input.c_str());
+      }
+      else if(argi.find("--autotune=true") == 0){
+        autotune=true;
+      }
+      else if(argi.find("--skip-land=true") == 0){
+        skip_land=true;
+      }
     }
 
     //4.1.2: If command line fails, manually input bounds
@@ -458,20 +671,174 @@ int main(int argc, char **argv){
     while (LAT[lat_ind_low] < lat_min)
       lat_ind_low++;
     
+    // Both longitudes are taken modulo 360 onto the stored range.  A
+    // box with lon_min > lon_max then crosses the grid seam (e.g.
+    // 170:-170 on a -180:180 grid); its indices continue past lon_size
+    // and wrap.
+    bool lon_wrap = normalizeLonBox(lon_min, lon_max, LON[0],
+                                    LON[lon_size-1]);
+
     int lon_ind_high=0;
-    while (LON[lon_ind_high] < lon_max)
+    while ((lon_ind_high < lon_size-1) && (LON[lon_ind_high] < lon_max))
       lon_ind_high++;
     int lon_ind_low=0;
-    while (LON[lon_ind_low] < lon_min)
+    while ((lon_ind_low < lon_size-1) && (LON[lon_ind_low] < lon_min))
       lon_ind_low++;
+    if (lon_wrap)
+      lon_ind_high += lon_size; // unwrapped index past the seam
+
+    // Longitude of unwrapped index k, continuous across the seam
+    auto lonAt = [&](int k){
+      return (k < lon_size) ? LON[k] : LON[k-lon_size] + 360;
+    };
+
+    int time_ind_high=0, time_ind_low=0;
+    if (catalog.empty() && agg_dir.empty()){
+      time_ind_high = min(timeAxis.lowerBound(tstop), (size_t)time_size-1);
+      time_ind_low = timeAxis.upperBound(tstart);
+      time_ind_low--; // one timestep back for inclusive range
+      time_ind_low = max(time_ind_low, 0);
+      timeAxis.fill(time_ind_low, time_ind_high);
+      if (timeAxis.reads() > 0)
+        cout << "TIME AXIS: " << timeAxis.reads() << " remote reads\n";
+    }
 
-    int time_ind_high=0;
-    while (TIME[time_ind_high] < tstop)
-      time_ind_high++;
-    int time_ind_low=0;
-    while (TIME[time_ind_low] <= tstart)
-      time_ind_low++;
-    time_ind_low--; // one timestep back for inclusive range
+    //---------------------------------------------------------------
+    // 4.1.5: Resolve output records to (dataset, time index)
+    // Without a catalog every record comes from dataURL.  With one, the
+    // date range is split over the experiments covering it (overlaps
+    // go to the earlier run) and each experiment's time axis is
+    // searched remotely.  Records are kept in time order; a record not
+    // later than the previous one is a duplicate and dropped.
+    vector<string> varNames;
+    varNames.push_back("salinity");
+    varNames.push_back("water_temp");
+    vector<string> urls;
+    vector<int>    rec_src;   // dataset of each output record
+    vector<size_t> rec_ind;   // time index within that dataset
+    vector<float>  rec_time;  // hours since 2000-01-01 00:00:00
+    vector<Experiment> used;  // catalog experiments, one per dataset
+
+    if (!catalog.empty() && !agg_dir.empty()){
+      cout << "(!) --catalog AND --aggregate CANNOT BE COMBINED" << endl;
+      return NC_ERR;
+    }
+    if (!agg_dir.empty()){
+      // One time axis over all files (in time order, duplicates
+      // dropped), bracketed like a single dataset; only the files
+      // holding selected records become sources.
+      vector<int> all_file;
+      vector<size_t> all_ind;
+      vector<float> all_time;
+      const vector<AggFile> &files = aggIndex.files();
+      for (size_t f=0; f<files.size(); f++)
+        for (size_t t=0; t<files[f].time.size(); t++)
+          if (all_time.empty() || (files[f].time[t] > all_time.back())){
+            all_file.push_back(f);
+            all_ind.push_back(t);
+            all_time.push_back(files[f].time[t]);
+          }
+      int n = all_time.size();
+      time_ind_high = lower_bound(all_time.begin(), all_time.end(),
+                                  (float)tstop) - all_time.begin();
+      time_ind_high = min(time_ind_high, n-1);
+      time_ind_low = upper_bound(all_time.begin(), all_time.end(),
+                                 (float)tstart) - all_time.begin();
+      time_ind_low = max(time_ind_low-1, 0);
+
+      map<int,int> src_of; // file -> source
+      for (int g=time_ind_low; g<=time_ind_high; g+=time_stride){
+        if (!src_of.count(all_file[g])){
+          const AggFile &file = files[all_file[g]];
+          if ((file.grid[0] != (size_t)depth_size) ||
+              (file.grid[1] != (size_t)lat_size) ||
+              (file.grid[2] != (size_t)lon_size)){
+            cout << "(!) GRID OF " << aggIndex.file(file.name)
+                 << " DIFFERS FROM " << dataURL << endl;
+            return NC_ERR;
+          }
+          src_of[all_file[g]] = urls.size();
+          urls.push_back(aggIndex.file(file.name));
+        }
+        rec_src.push_back(src_of[all_file[g]]);
+        rec_ind.push_back(all_ind[g]);
+        rec_time.push_back(all_time[g]);
+      }
+    }
+    else if (catalog.empty()){
+      urls.push_back(dataURL);
+      for (int t=time_ind_low; t<=time_ind_high; t+=time_stride){
+        rec_src.push_back(0);
+        rec_ind.push_back(t);
+        rec_time.push_back(TIME[t]);
+      }
+    }
+    else{
+      vector<Experiment> cat = builtinCatalog();
+      if ((catalog != "builtin") && !loadCatalog(catalog, cat)){
+        cout << "(!) CANNOT READ CATALOG: " << catalog << endl;
+        return NC_ERR;
+      }
+      used = resolveCatalog(cat, tstart, tstop);
+      for (size_t e=0; e<used.size(); e++)
+        urls.push_back(used[e].url);
+    }
+    for (size_t s=0; s<urls.size(); s++)
+      if (!isRemote(urls[s]))
+        combined = false; // no DAP server behind local files
+    SourceSet sources(urls, varNames, max_open);
+    for (size_t s=0; s<urls.size(); s++)
+      if (urls[s] == dataURL)
+        sources.attach(s, dataFile);
+
+    if (!catalog.empty()){
+      cout << "-----------------------\n";
+      cout << "EXPERIMENTS:" << endl;
+      for (int s=0; s<sources.size(); s++){
+        NcFile &file = sources.file(s);
+        if ((file.getDim("depth").getSize() != (size_t)depth_size) ||
+            (file.getDim("lat").getSize() != (size_t)lat_size) ||
+            (file.getDim("lon").getSize() != (size_t)lon_size)){
+          cout << "(!) GRID OF " << used[s].name << " DIFFERS FROM "
+               << dataURL << endl;
+          return NC_ERR;
+        }
+        NcVar expTime = file.getVar("time");
+        size_t n = expTime.getDim(0).getSize();
+        vector<float> T(n);
+        LazyAxis axis(expTime, &T[0], n);
+
+        // first experiment: one step back from tstart (as above);
+        // last: up to the first record at/after tstop
+        bool last = (s == sources.size()-1);
+        long lo = (s == 0) ? (long)axis.upperBound(tstart) - 1
+                           : (long)axis.lowerBound(used[s].t0);
+        long hi = last ? (long)min(axis.lowerBound(tstop), n-1)
+                       : (long)axis.lowerBound(used[s].t1) - 1;
+        lo = max(lo, 0L);
+        size_t nrec0 = rec_time.size();
+        if (hi >= lo){
+          axis.fill(lo, hi);
+          for (long t=lo; t<=hi; t+=time_stride){
+            if (!rec_time.empty() && (T[t] <= rec_time.back()))
+              continue;
+            rec_src.push_back(s);
+            rec_ind.push_back(t);
+            rec_time.push_back(T[t]);
+          }
+        }
+        cout << "  " << used[s].name << ": "
+             << rec_time.size() - nrec0 << " records";
+        if (rec_time.size() > nrec0)
+          cout << ", TIME = " << rec_time[nrec0] << ":" << rec_time.back();
+        cout << endl;
+      }
+      cout << endl;
+    }
+    if (rec_time.empty()){
+      cout << "(!) NO RECORDS IN REQUESTED TIME RANGE" << endl;
+      return NC_ERR;
+    }
 
     cout << "-----------------------\n";
     cout << "SPATIAL RANGE:" << endl;
@@ -488,28 +855,53 @@ int main(int argc, char **argv){
     cout << "  LAT[" << lat_ind_low << ":" << lat_ind_high << "] = "
          << LAT[lat_ind_low] << ":" << LAT[lat_ind_high] << "\n";
     cout << "  LON[" << lon_ind_low << ":" << lon_ind_high << "] = "
-         << LON[lon_ind_low] << ":" << LON[lon_ind_high] << "\n";
-    cout << "  TIME[" << time_ind_low << ":" << time_ind_high << "] = "
-         << TIME[time_ind_low] << ":" << TIME[time_ind_high] << "\n";
+         << lonAt(lon_ind_low) << ":" << lonAt(lon_ind_high)
+         << (lon_wrap ? "  (across grid seam)" : "") << "\n";
+    if (!agg_dir.empty())
+      cout << "  TIME  = " << rec_time.front() << ":" << rec_time.back()
+           << " [" << urls.size() << " files]\n";
+    else if (catalog.empty())
+      cout << "  TIME[" << time_ind_low << ":" << time_ind_high << "] = "
+           << TIME[time_ind_low] << ":" << TIME[time_ind_high] << "\n";
+    else
+      cout << "  TIME  = " << rec_time.front() << ":" << rec_time.back()
+           << " [" << urls.size() << " experiments]\n";
     cout << endl;
 
-    // Index Ranges (+1 for inclusive)
-    int lat_ind_range = lat_ind_high - lat_ind_low +1;
-    int lon_ind_range = lon_ind_high - lon_ind_low +1;
-    int depth_ind_range = depth_ind_high - depth_ind_low +1;
-    int ntime = time_ind_high - time_ind_low +1;
+    // Index Ranges (+1 for inclusive), in points of the strided grid
+    int lat_ind_range = (lat_ind_high - lat_ind_low)/lat_stride +1;
+    int lon_ind_range = (lon_ind_high - lon_ind_low)/lon_stride +1;
+    int depth_ind_range = (depth_ind_high - depth_ind_low)/depth_stride +1;
+    int ntime = rec_time.size();
+    if ((depth_stride*lat_stride*lon_stride*time_stride) > 1)
+      cout << "STRIDES: depth=" << depth_stride << " lat=" << lat_stride
+           << " lon=" << lon_stride << " time=" << time_stride
+           << "  -> [" << ntime << "][" << depth_ind_range << "]["
+           << lat_ind_range << "][" << lon_ind_range << "]\n" << endl;
 
     //---------------------------------------------------------------
     // 4.2: Initialize 3D arrays
-    short int preSALT[depth_ind_range][lat_ind_range][lon_ind_range];
-    short int preTEMP[depth_ind_range][lat_ind_range][lon_ind_range];
-    //float SALT[ntime][depth_ind_range][lat_ind_range][lon_ind_range];
-    //float TEMP[ntime][depth_ind_range][lat_ind_range][lon_ind_range];
-
-    typedef boost::multi_array<float, 4> array_float4D;
-    typedef array_float4D::index index;
-    array_float4D SALT(boost::extents[ntime][depth_ind_range][lat_ind_range][lon_ind_range]);
-    array_float4D TEMP(boost::extents[ntime][depth_ind_range][lat_ind_range][lon_ind_range]);
+    // Each read fetches 'nrec_read' consecutive records in one
+    // hyperslab; 'auto' fits as many records as the read budget allows.
+    int slab_size = depth_ind_range*lat_ind_range*lon_ind_range;
+    int nrec_read = records_per_read;
+    if (nrec_read <= 0){
+      double record_bytes = 2.0*slab_size*sizeof(short); // both variables
+      nrec_read = (int)(read_budget_mb*1024*1024/record_bytes);
+    }
+    if (nrec_read < 1)
+      nrec_read = 1;
+    if (nrec_read > ntime)
+      nrec_read = ntime;
+
+    // Streaming holds one batch at a time: each is written to the new
+    // file (step 6) before the next is unpacked
+    if (stream && !newfile){
+      cout << "(!) --stream=true WRITES AS IT READS: USE --newfile=true"
+           << endl;
+      return NC_ERR;
+    }
+    int nrec_held = stream ? nrec_read : ntime;
 
     NcVar saltVar, tempVar;
     saltVar = dataFile.getVar("salinity");
@@ -522,58 +914,81 @@ int main(int argc, char **argv){
 
     //---------------------------------------------------------------
     // 4.3: Write vectors to specify desired 4D data range
-    vector<size_t> startp,countp;
+    vector<size_t> startp,countp,stridep;
     startp.push_back(0);             //start: overwritten in step (4.5)
     startp.push_back(depth_ind_low); //start: depth = shallow depth index
     startp.push_back(lat_ind_low);   //start: lat   = low lat index
     startp.push_back(lon_ind_low);   //start: lon   = low lon index
-    countp.push_back(1);               //count: one record at a time
+    countp.push_back(nrec_read);       //count: records per read
     countp.push_back(depth_ind_range); //count: depth index range
     countp.push_back(lat_ind_range);   //count: latitude index range
     countp.push_back(lon_ind_range);   //count: longitude index range
+    stridep.push_back(time_stride);    //stride: records
+    stridep.push_back(depth_stride);   //stride: depth levels
+    stridep.push_back(lat_stride);     //stride: latitudes
+    stridep.push_back(lon_stride);     //stride: longitudes
 
     for (int i=0; i<4; i++){
       cout << "startp[" << i << "] = " << startp[i] << endl;
       cout << "countp[" << i << "] = " << countp[i] << endl;
+      cout << "stridep[" << i << "] = " << stridep[i] << endl;
     }
 
     //---------------------------------------------------------------
     // 4.4 Determine offset & scale factor from variable attributes
-    NcVarAtt scaleAtt, offsetAtt, missingAtt;
     float scale_factor_SALT[1], add_offset_SALT[1], no_val_SALT[1];
     float scale_factor_TEMP[1], add_offset_TEMP[1], no_val_TEMP[1];
 
     // Temperature:
-    scaleAtt = tempVar.getAtt("scale_factor");
-    if (scaleAtt.isNull()) return NC_ERR;
-    scaleAtt.getValues(scale_factor_TEMP);
-
-    offsetAtt = tempVar.getAtt("add_offset");
-    if (offsetAtt.isNull()) return NC_ERR;
-    offsetAtt.getValues(add_offset_TEMP);
-
-    missingAtt = tempVar.getAtt("missing_value");
-    if (missingAtt.isNull()) return NC_ERR;
-    missingAtt.getValues(no_val_TEMP);
+    if (!meta.att(tempVar, "scale_factor", scale_factor_TEMP)) return NC_ERR;
+    if (!meta.att(tempVar, "add_offset", add_offset_TEMP)) return NC_ERR;
+    if (!meta.att(tempVar, "missing_value", no_val_TEMP)) return NC_ERR;
 
     // Salinity:
-    scaleAtt = saltVar.getAtt("scale_factor");
-    if (scaleAtt.isNull()) return NC_ERR;
-    scaleAtt.getValues(scale_factor_SALT);
-
-    offsetAtt = saltVar.getAtt("add_offset");
-    if (offsetAtt.isNull()) return NC_ERR;
-    offsetAtt.getValues(add_offset_SALT);
-
-    missingAtt = saltVar.getAtt("missing_value");
-    if (missingAtt.isNull()) return NC_ERR;
-    missingAtt.getValues(no_val_SALT);
+    if (!meta.att(saltVar, "scale_factor", scale_factor_SALT)) return NC_ERR;
+    if (!meta.att(saltVar, "add_offset", add_offset_SALT)) return NC_ERR;
+    if (!meta.att(saltVar, "missing_value", no_val_SALT)) return NC_ERR;
 
     cout << "Temperature Scale, Offset = "
          << scale_factor_TEMP[0] << "," << add_offset_TEMP[0] << endl;
     cout << "Salinity Scale, Offset = "
          << scale_factor_SALT[0] << "," << add_offset_SALT[0] << endl;
 
+    // Packing of the new file (step 6)
+    float ADD_OFFSET = 20;
+    float SCALE_FACTOR = 0.001;
+    short NO_VALUE = -30000;
+
+    // Pass-through: a variable packed in the source exactly like the new
+    // file is written from the shorts as served, without the round trip
+    // through floats (which costs two passes and can round differently).
+    // Packed mode holds the records as served, at half the memory of
+    // the float arrays, and decodes them where they are used.
+    Packing packing_SALT = {scale_factor_SALT[0], add_offset_SALT[0],
+                            no_val_SALT[0]};
+    Packing packing_TEMP = {scale_factor_TEMP[0], add_offset_TEMP[0],
+                            no_val_TEMP[0]};
+    Packing packing_out = {SCALE_FACTOR, ADD_OFFSET, (float)NO_VALUE};
+    bool raw[2] = {newfile && packing_SALT.same(packing_out),
+                   newfile && packing_TEMP.same(packing_out)};
+    cout << "PASS-THROUGH:     " << (raw[0] ? "salinity " : "")
+         << (raw[1] ? "water_temp" : "") << ((raw[0] || raw[1]) ? "" : "off")
+         << endl;
+    if (raw[0] || raw[1])
+      packed = true;
+
+    int nrec_packed = packed ? nrec_held : 0;
+    PackedCube packedSALT(nrec_packed, depth_ind_range, lat_ind_range,
+                          lon_ind_range, packing_SALT);
+    PackedCube packedTEMP(nrec_packed, depth_ind_range, lat_ind_range,
+                          lon_ind_range, packing_TEMP);
+
+    int nrec_float = packed ? 0 : nrec_held;
+    typedef Tensor4<float> array_float4D; // [time][depth][lat][lon]
+    typedef array_float4D::index index;
+    array_float4D SALT(nrec_float, depth_ind_range, lat_ind_range, lon_ind_range);
+    array_float4D TEMP(nrec_float, depth_ind_range, lat_ind_range, lon_ind_range);
+
 
     //---------------------------------------------------------------
     // 4.5: Fill data arrays, multiply by scale factor, add offset
@@ -585,49 +1000,432 @@ int main(int argc, char **argv){
     cout << "--------------------------------\n";
     cout << "READING NETCDF DATA FILE... \n";
     
-    for (index rec=0; rec<ntime; rec++){
-      startp[0] = (time_ind_low + rec);
-      saltVar.getVar(startp,countp,preSALT);
-      tempVar.getVar(startp,countp,preTEMP);
-
-      int time_ind = startp[0];
-      cout << "TIME STAMP: " << TIME[time_ind]
-           << " hours since 2000-01-01 00:00:00 "
-           << "[" << rec << "/" << ntime << "]" << endl;
-      
-      for (index i=0; i<depth_ind_range; i++){
-        for (index j=0; j<lat_ind_range; j++){
-          for (index k=0; k<lon_ind_range; k++){
+    cout << "RECORDS PER READ: " << nrec_read << endl;
+    cout << "READ BUFFERS:     " << prefetch_depth << endl;
+    cout << "COMBINED DAP:     " << (combined ? "yes" : "no") << endl;
+    cout << "FETCH WORKERS:    " << nworkers << endl;
+    cout << "TILE LIMIT [MB]:  " << tile_mb << endl;
+    cout << "TILE CACHE:       " << (cache_dir.empty() ? "off" : cache_dir)
+         << endl;
+
+    // NCSS transport: a run is fetched as one server-compressed NetCDF-4
+    // subset instead of DAP tiles.  NCSS takes one horizontal stride and
+    // all depth levels (or one), and cannot cross the lon seam; such
+    // boxes stay on DAP.
+    unique_ptr<NcssClient> ncss;
+    if ((transport != "dap") && (transport != "ncss") && (transport != "auto")){
+      cout << "(!) UNKNOWN TRANSPORT: " << transport << endl;
+      return NC_ERR;
+    }
+    if (transport != "dap"){
+      if (lon_wrap || (depth_stride > 1) || (lat_stride != lon_stride))
+        cout << "(!) NCSS CANNOT EXPRESS THIS BOX, USING DAP" << endl;
+      else{
+        const char *tmp = getenv("TMPDIR");
+        ncss.reset(new NcssClient(tmp ? tmp : "/tmp"));
+      }
+    }
+    cout << "TRANSPORT:        " << (ncss ? transport : "dap");
+    if (ncss && (transport == "auto"))
+      cout << " (NCSS above " << ncss_mb << " MB per run)";
+    cout << endl;
+    int nncss = 0;
+
+    // Combined mode bypasses netcdf-c for the data reads and asks the
+    // DAP server for both variables in a single '.dods' request.
+    vector<short> tile_tmp;
+    int njobs = 0;
+
+    // Worker mode forks the fetch processes now, before the pipeline
+    // thread exists; each batch is split into jobs across the workers
+    // and assembled in shared memory.
+    unique_ptr<FetchPool> pool;
+    if (nworkers > 0){
+      vector<size_t> cube = countp;
+      cube[0] = nrec_read;
+      pool.reset(new FetchPool(urls, varNames, cube, nworkers, max_open));
+    }
 
-          if (preTEMP[i][j][k] != no_val_TEMP[0])
-            TEMP[rec][i][j][k] = (preTEMP[i][j][k] * scale_factor_TEMP[0])
-              + add_offset_TEMP[0];
-          else
-            TEMP[rec][i][j][k] = no_val_TEMP[0];
+    // Tile cache: cached blocks are copied in first and only the
+    // remaining holes are planned as jobs; fetched jobs are stored back.
+    unique_ptr<TileCache> cache;
+    if (!cache_dir.empty())
+      cache.reset(new TileCache(cache_dir, cache_mb*1024*1024));
+
+    // Autotune: tile size and requests in flight follow the measured
+    // throughput of each batch (AIMD), starting from the flags given;
+    // failed fetches are retried with both cut back.
+    unique_ptr<FetchTuner> tuner;
+    if (autotune){
+      tuner.reset(new FetchTuner((tile_mb > 0 ? tile_mb : 64)*1048576,
+                                 max(nworkers/2, 1), max(nworkers, 1)));
+      cout << "AUTOTUNE:         on" << endl;
+    }
 
-          if (preSALT[i][j][k] != no_val_SALT[0])
-            SALT[rec][i][j][k] = (preSALT[i][j][k] * scale_factor_SALT[0])
-              + add_offset_SALT[0];
-          else
-            SALT[rec][i][j][k] = no_val_SALT[0];
+    // Land index: tiles known to be all land are not fetched but filled
+    // with the missing value; each fetched block teaches the index more
+    // of the grid's land mask, which is kept next to the metadata cache.
+    unique_ptr<LandIndex> land;
+    short missing[2] = {(short)no_val_SALT[0], (short)no_val_TEMP[0]};
+    if (skip_land){
+      land.reset(new LandIndex(meta_dir, urls, DEPTH, depth_size, LAT,
+                               lat_size, LON, lon_size));
+      cout << "LAND INDEX:       " << 100*land->known() << "% of cells known"
+           << endl;
+    }
+
+    // While batch 'b' is unpacked here, the pipeline thread is already
+    // reading batch 'b+1' (up to prefetch_depth-1 batches ahead).
+    // Only that thread may call netCDF until the pipeline is joined;
+    // when streaming, the writer takes turns with it on nc_mutex, which
+    // it holds for its netCDF calls only (DAP, NCSS downloads and the
+    // workers run while the writer writes).
+    // readData() runs the whole loop, handing each unpacked batch to
+    // 'consume' (rec0, nrec); streaming calls it from step 6.
+    int nbatch = (ntime + nrec_read - 1)/nrec_read;
+    double decode_time = 0;
+    mutex nc_mutex;
+    auto netcdf = [&](const function<void()> &call){
+      unique_lock<mutex> nc_lock(nc_mutex, defer_lock);
+      if (stream)
+        nc_lock.lock();
+      call();
+    };
+    auto readData = [&](function<void(int,int)> consume){
+      double loop_start = hycom_clock();
+      BatchPipeline pipeline(nbatch, prefetch_depth, 2, nrec_read*slab_size,
+        [&](int b, BatchPipeline::Buffers &buf){
+          int rec0 = b*nrec_read;
+          int nrec = min(nrec_read, ntime - rec0);
+          double tile_bytes = tuner ? tuner->tileBytes() : tile_mb*1048576;
+          int inflight = (tuner && pool) ? tuner->inflight() : nworkers;
+
+          // Workers assemble in shared memory, otherwise read in place
+          vector<short*> out;
+          out.push_back(pool ? pool->buffer(0) : &buf[0][0]);
+          out.push_back(pool ? pool->buffer(1) : &buf[1][0]);
+
+          // Run 'fetch'; with autotune a failure (a timeout included)
+          // cuts the tile size and requests in flight, and 'fetch' is
+          // retried after 'replan' and a back-off, up to 3 times
+          auto retry = [&](const function<void()> &fetch,
+                           const function<void()> &replan){
+            for (int attempt=0; ; attempt++){
+              try{
+                fetch();
+                return;
+              }
+              catch(exception &e){
+                if (!tuner || (attempt >= 3) ||
+                    (pool && !pool->liveCount()))
+                  throw;
+                tuner->failure();
+                tile_bytes = tuner->tileBytes();
+                if (pool)
+                  inflight = min(tuner->inflight(), pool->liveCount());
+                cout << "(!) FETCH FAILED, RETRY IN " << (1 << attempt)
+                     << " s WITH " << tile_bytes/1048576 << " MB TILES, "
+                     << inflight << " IN FLIGHT: " << e.what() << endl;
+                sleep(1 << attempt);
+                replan();
+              }
+            }
+          };
+
+          // A run is a stretch of records from one dataset with evenly
+          // strided time indices: one hyperslab along time.  A batch
+          // has more than one run only where it crosses experiments.
+          struct Run { int src, r0; vector<size_t> start, count;
+                       size_t j0, j1; };
+          vector<Run> runs;
+          for (int r0=0, r1=0; r0<nrec; r0=r1){
+            Run run;
+            run.src = rec_src[rec0+r0];
+            run.r0 = r0;
+            for (r1=r0+1; r1<nrec; r1++)
+              if ((rec_src[rec0+r1] != run.src) || (rec_ind[rec0+r1] !=
+                   rec_ind[rec0+r0] + (size_t)(r1-r0)*time_stride))
+                break;
+            run.start = startp;
+            run.count = countp;
+            run.start[0] = rec_ind[rec0+r0];
+            run.count[0] = r1 - r0;
+
+            vector<short*> rout;
+            for (size_t v=0; v<out.size(); v++)
+              rout.push_back(out[v] + r0*slab_size);
+
+            // NCSS: the whole run as one subset file, located in the
+            // file by its first coordinates (bounds padded for float
+            // round-off)
+            bool by_ncss = ncss && isRemote(urls[run.src]) &&
+              ((transport == "ncss") ||
+               (WIRE_BYTES*2.0*run.count[0]*slab_size >= ncss_mb*1048576));
+            if (by_ncss){
+              NcssQuery q;
+              q.vars = varNames;
+              q.south = LAT[lat_ind_low] - 1e-4;
+              q.north = LAT[lat_ind_low+(lat_ind_range-1)*lat_stride] + 1e-4;
+              q.west = LON[lon_ind_low] - 1e-4;
+              q.east = LON[lon_ind_low+(lon_ind_range-1)*lon_stride] + 1e-4;
+              q.horiz_stride = lat_stride;
+              q.t0 = rec_time[rec0+r0];
+              q.t1 = rec_time[rec0+r1-1];
+              q.time_stride = time_stride;
+              q.all_levels = (depth_ind_range > 1);
+              q.depth = DEPTH[depth_ind_low];
+              string path;
+              retry([&](){ path = ncss->download(urls[run.src], q); },
+                    [](){});
+              double first[4] = {rec_time[rec0+r0], DEPTH[depth_ind_low],
+                                 LAT[lat_ind_low], LON[lon_ind_low]};
+              size_t dst[4] = {(size_t)r0, 0, 0, 0};
+              try{
+                netcdf([&](){
+                    readSubset(path, varNames, first, &run.count[0], countp,
+                               dst, out);
+                  });
+              }
+              catch(...){
+                unlink(path.c_str());
+                throw;
+              }
+              unlink(path.c_str());
+              nncss++;
+              if (cache){
+                FetchJob whole;
+                whole.src = run.src;
+                whole.var = -1;
+                for (int d=0; d<4; d++){
+                  whole.start[d] = run.start[d];
+                  whole.count[d] = run.count[d];
+                  whole.stride[d] = stridep[d];
+                  whole.dst[d] = 0;
+                }
+                cache->storeBatch(urls[run.src], varNames,
+                                  vector<FetchJob>(1, whole), run.start,
+                                  run.count, stridep, rout, lon_size);
+              }
+              continue;
+            }
+            runs.push_back(run);
+          }
+
+          // Tiles under the byte limit, each placed at its offset; a
+          // box across the lon seam gets separate jobs on either side
+          vector<FetchJob> jobs;
+          double bytes = 0;
+          auto planRuns = [&](){
+            jobs.clear();
+            bytes = 0;
+            for (size_t r=0; r<runs.size(); r++){
+              Run &run = runs[r];
+              vector<short*> rout;
+              for (size_t v=0; v<out.size(); v++)
+                rout.push_back(out[v] + run.r0*slab_size);
+              vector<FetchJob> part;
+              if (cache)
+                part = cache->planBatch(urls[run.src], varNames, run.start,
+                                        run.count, stridep, rout, combined,
+                                        tile_bytes, 2*inflight, lon_size);
+              else
+                part = planJobs(2, combined, run.start, run.count, stridep,
+                                tile_bytes, 2*inflight, lon_size);
+              run.j0 = jobs.size();
+              for (size_t j=0; j<part.size(); j++){
+                part[j].src = run.src;
+                part[j].dst[0] += run.r0;
+                FetchJob whole = part[j];
+                LandIndex::Trim trim = land ? land->trimJob(part[j], 2)
+                                            : LandIndex::KEEP;
+                for (int v=0; (trim != LandIndex::KEEP) && (v<2); v++)
+                  if ((whole.var < 0) || (whole.var == v))
+                    fillJob(whole, missing[v], out[v], countp);
+                if (trim != LandIndex::SKIP){
+                  jobs.push_back(part[j]);
+                  bytes += jobBytes(part[j], 2);
+                }
+              }
+              run.j1 = jobs.size();
+            }
+          };
+          planRuns();
+
+          // Jobs only fill their own blocks, so a failed batch can be
+          // run again; it is re-planned with the reduced tile size and
+          // retried on the live workers
+          double f0 = hycom_clock();
+          retry([&](){
+                  if (pool)
+                    pool->run(jobs, inflight);
+                  else
+                    for (size_t j=0; j<jobs.size(); j++){
+                      if (jobs[j].var < 0) // combined DAP, no netCDF
+                        readJob(jobs[j], sources, varNames, countp, out,
+                                tile_tmp);
+                      else
+                        netcdf([&](){
+                            readJob(jobs[j], sources, varNames, countp,
+                                    out, tile_tmp);
+                          });
+                    }
+                },
+                [&](){
+                  planRuns();
+                  f0 = hycom_clock();
+                });
+          njobs += jobs.size();
+          // The land mask is learned from each whole run, cached and
+          // land-filled blocks included: one block must span a cell
+          for (size_t r=0; land && (r<runs.size()); r++){
+            FetchJob box;
+            for (int d=0; d<4; d++){
+              box.start[d] = runs[r].start[d];
+              box.count[d] = runs[r].count[d];
+              box.stride[d] = stridep[d];
+              box.dst[d] = 0;
+            }
+            box.src = runs[r].src;
+            box.dst[0] = runs[r].r0;
+            land->learn(box, out, countp, missing);
+          }
+          if (tuner){
+            tuner->success(bytes, hycom_clock() - f0, jobs.size());
+            if (verbose)
+              cout << "AUTOTUNE: " << tuner->lastRate()/1048576 << " MB/s, "
+                   << tuner->latency() << " s/request -> tile "
+                   << tuner->tileBytes()/1048576 << " MB, "
+                   << tuner->inflight() << " in flight" << endl;
+          }
+
+          for (size_t r=0; cache && (r<runs.size()); r++){
+            vector<FetchJob> part(jobs.begin()+runs[r].j0,
+                                  jobs.begin()+runs[r].j1);
+            vector<short*> rout;
+            for (size_t j=0; j<part.size(); j++)
+              part[j].dst[0] -= runs[r].r0;
+            for (size_t v=0; v<out.size(); v++)
+              rout.push_back(out[v] + runs[r].r0*slab_size);
+            cache->storeBatch(urls[runs[r].src], varNames, part,
+                              runs[r].start, runs[r].count, stridep, rout,
+                              lon_size);
+          }
+          if (pool){
+            size_t n = nrec*slab_size;
+            copy(pool->buffer(0), pool->buffer(0)+n, buf[0].begin());
+            copy(pool->buffer(1), pool->buffer(1)+n, buf[1].begin());
+          }
+        });
+
+      for (int batch=0; batch<nbatch; batch++){
+        BatchPipeline::Buffers &buf = pipeline.acquire(batch);
+        const BatchPipeline::Buffer &preSALT = buf[0];
+        const BatchPipeline::Buffer &preTEMP = buf[1];
+        double t0 = hycom_clock();
+
+        index rec0 = batch*nrec_read;
+        index nrec = min((index)nrec_read, ntime-rec0);
+        for (index r=0; r<nrec; r++){
+          index rec = rec0 + r;
+          index slot = stream ? r : rec; // record 'rec' in the arrays
+          cout << "TIME STAMP: " << rec_time[rec]
+               << " hours since 2000-01-01 00:00:00 "
+               << "[" << rec << "/" << ntime << "]" << endl;
+          if (packed){
+            copy(&preSALT[r*slab_size], &preSALT[r*slab_size]+slab_size,
+                 packedSALT.record(slot));
+            copy(&preTEMP[r*slab_size], &preTEMP[r*slab_size]+slab_size,
+                 packedTEMP.record(slot));
+            continue;
+          }
+
+          int n = r*slab_size; // first element of record 'r' in batch
+          for (index i=0; i<depth_ind_range; i++){
+            for (index j=0; j<lat_ind_range; j++){
+              for (index k=0; k<lon_ind_range; k++, n++){
+
+              if (preTEMP[n] != no_val_TEMP[0])
+                TEMP(slot,i,j,k) = (preTEMP[n] * scale_factor_TEMP[0])
+                  + add_offset_TEMP[0];
+              else
+                TEMP(slot,i,j,k) = no_val_TEMP[0];
+
+              if (preSALT[n] != no_val_SALT[0])
+                SALT(slot,i,j,k) = (preSALT[n] * scale_factor_SALT[0])
+                  + add_offset_SALT[0];
+              else
+                SALT(slot,i,j,k) = no_val_SALT[0];
+              }
+            }
           }
         }
+
+        decode_time += hycom_clock() - t0;
+        if (consume)
+          consume(rec0, nrec);
+        pipeline.release(batch);
       }
-    }
+      pipeline.join();
+
+      double loop_time = hycom_clock() - loop_start;
+      cout << "--------------------------------\n";
+      cout << "READ PIPELINE TIMINGS [s]:\n";
+      cout << "  fetch   = " << pipeline.fetchTime() << "\n";
+      cout << "  decode  = " << decode_time << "\n";
+      cout << "  wait    = " << pipeline.waitTime()
+           << " (decode idle, waiting on fetch)\n";
+      cout << "  stall   = " << pipeline.stallTime()
+           << " (fetch idle, all buffers full)\n";
+      cout << "  wall    = " << loop_time << "\n";
+      cout << "  overlap = "
+           << pipeline.fetchTime() + decode_time - loop_time << endl;
+      cout << "  requests = " << njobs << endl;
+      DapStats dap = pool ? pool->dapStats() : sources.dapStats();
+      if (dap.requests > 0){
+        cout << "  connections = " << dap.connects << " opened, "
+             << dap.reused() << " reused" << endl;
+        cout << "  transfer [MB] = " << dap.wire/1048576 << " on the wire, "
+             << dap.body/1048576 << " decoded (x" << dap.ratio() << ")"
+             << endl;
+      }
+      if (ncss)
+        cout << "  ncss     = " << nncss << " subsets, "
+             << ncss->bytes()/1048576 << " MB downloaded" << endl;
+      if (pool)
+        cout << "  workers  = " << pool->workerCount() << endl;
+      if (tuner)
+        cout << "  autotune = " << tuner->bestRate()/1048576
+             << " MB/s best, " << tuner->failures() << " retries\n"
+             << "  autotuned flags: " << tuner->flags() << endl;
+      if (!agg_dir.empty())
+        cout << "  files    = " << urls.size() << " (opened here: "
+             << sources.opens() << ", max open " << max_open << ")" << endl;
+      if (land){
+        cout << "  land     = " << land->skipped() << " requests skipped, "
+             << land->savedBytes()/1048576 << " MB not fetched, "
+             << 100*land->known() << "% of cells known" << endl;
+        land->save();
+      }
+      pool.reset(); // stop the fetch workers
+      if (cache){
+        cache->trim();
+        cout << "  cache hit  [MB] = " << cache->hitBytes()/1048576 << "\n";
+        cout << "  cache miss [MB] = " << cache->missBytes()/1048576 << "\n";
+        cout << "  cache evictions = " << cache->evicted() << endl;
+      }
+    };
+    if (!stream)
+      readData(nullptr);
 
 
     //---------------------------------------------------------------
     // 5. ENSURE CORRECT UNITS
     //---------------------------------------------------------------
-    NcVarAtt unitsAtt;
     string depthUnits, latUnits, lonUnits, saltUnits, tempUnits;
 
     //---------------------------------------------------------------
     // 5.1: Depth
-    unitsAtt = depthVar.getAtt("units");
-    if(unitsAtt.isNull()) return NC_ERR;
-    
-    unitsAtt.getValues(depthUnits);
+    if (!meta.text(depthVar, "units", depthUnits)) return NC_ERR;
     if (depthUnits != "m")
       {
         cout<<"WARNING! depth units = "<<depthUnits<<endl;
@@ -636,10 +1434,7 @@ int main(int argc, char **argv){
 
     //---------------------------------------------------------------
     // 5.2: Latitude
-    unitsAtt = latVar.getAtt("units");
-    if(unitsAtt.isNull()) return NC_ERR;
-    
-    unitsAtt.getValues(latUnits);
+    if (!meta.text(latVar, "units", latUnits)) return NC_ERR;
     if (latUnits != "degrees_north")
       {
         cout<<"WARNING! latitude units = "<<latUnits<<endl;
@@ -648,10 +1443,7 @@ int main(int argc, char **argv){
    
     //---------------------------------------------------------------
     // 5.3: Longitude
-    unitsAtt = lonVar.getAtt("units");
-    if(unitsAtt.isNull()) return NC_ERR;
-   
-    unitsAtt.getValues(lonUnits);
+    if (!meta.text(lonVar, "units", lonUnits)) return NC_ERR;
     if (lonUnits != "degrees_east")
       {
         cout<<"WARNING! longitude units = "<<lonUnits<<endl;
@@ -660,10 +1452,7 @@ int main(int argc, char **argv){
 
     //---------------------------------------------------------------
     // 5.4: Salinity
-    unitsAtt = saltVar.getAtt("units");
-    if(unitsAtt.isNull()) return NC_ERR;
-   
-    unitsAtt.getValues(saltUnits);
+    if (!meta.text(saltVar, "units", saltUnits)) return NC_ERR;
     if (saltUnits != "psu")
       {
         cout<<"WARNING! salinity units = "<<saltUnits<<endl;
@@ -672,27 +1461,32 @@ int main(int argc, char **argv){
 
     //---------------------------------------------------------------
     // 5.5: Temperature
-    unitsAtt = tempVar.getAtt("units");
-    if(unitsAtt.isNull()) return NC_ERR;
-   
-    unitsAtt.getValues(tempUnits);
+    if (!meta.text(tempVar, "units", tempUnits)) return NC_ERR;
     if (tempUnits != "degC")
       {
         cout<<"WARNING! temperature units = "<<tempUnits<<endl;
         return NC_ERR;
       }
 
+    cout << "METADATA: " << (meta.hit() ? "from cache" : "from server")
+         << endl;
+    meta.save();
+
     // The file will be automatically closed by the destructor. This
     // frees up any internal netCDF resources associated with the file,
     // and flushes any buffers.
     cout << "--------------------------------\n";
-    cout << "* NETCDF DATA READ SUCCESSFUL! *\n";
+    cout << (stream ? "* STREAMING: READ WHILE WRITING *\n"
+                    : "* NETCDF DATA READ SUCCESSFUL! *\n");
     cout << "--------------------------------\n";
     cout << "ARRAYS CREATED:\n";
-    cout << "  SALT[" << ntime << "][" << depth_ind_range << "]["
+    cout << "  SALT[" << nrec_held << "][" << depth_ind_range << "]["
          << lat_ind_range << "][" << lon_ind_range << "]\n";
-    cout << "  TEMP[" << ntime << "][" << depth_ind_range << "]["
+    cout << "  TEMP[" << nrec_held << "][" << depth_ind_range << "]["
          << lat_ind_range << "][" << lon_ind_range << "]\n";
+    if (packed)
+      cout << "  (packed, "
+           << (packedSALT.bytes() + packedTEMP.bytes())/1048576.0 << " MB)\n";
     cout << endl;
 
     if (!newfile){
@@ -735,9 +1529,8 @@ int main(int argc, char **argv){
 
     //---------------------------------------------------------------
     // 6.0.4: Define variable scale and offsets
-    float ADD_OFFSET = 20;
-    float SCALE_FACTOR = 0.001;
-    short NO_VALUE = -30000;
+    // ADD_OFFSET, SCALE_FACTOR and NO_VALUE are set in 4.4, where the
+    // pass-through check needs them
 
     cout << "-> Constants defined." << endl;
     
@@ -858,19 +1651,19 @@ int main(int argc, char **argv){
 
     //---------------------------------------------------------------
     // 6.4.1: Fill coordinate (independent) VARIABLES
-    float TIME_OUT[ntime];
-    float DEPTH_OUT[depth_ind_range];
-    float LAT_OUT[lat_ind_range];
-    float LON_OUT[lon_ind_range];
+    AlignedBuffer<float> TIME_OUT(ntime);
+    AlignedBuffer<float> DEPTH_OUT(depth_ind_range);
+    AlignedBuffer<float> LAT_OUT(lat_ind_range);
+    AlignedBuffer<float> LON_OUT(lon_ind_range);
 
     for (int rec=0; rec<ntime; rec++)
-      TIME_OUT[rec] = TIME[time_ind_low+rec];
+      TIME_OUT[rec] = rec_time[rec];
     for (int i=0; i<depth_ind_range; i++)
-      DEPTH_OUT[i] = DEPTH[depth_ind_low+i];
+      DEPTH_OUT[i] = DEPTH[depth_ind_low+i*depth_stride];
     for (int j=0; j<lat_ind_range; j++)
-      LAT_OUT[j] = LAT[lat_ind_low+j];
+      LAT_OUT[j] = LAT[lat_ind_low+j*lat_stride];
     for (int k=0; k<lon_ind_range; k++)
-      LON_OUT[k] = LON[lon_ind_low+k];
+      LON_OUT[k] = lonAt(lon_ind_low+k*lon_stride);
 
     timeVarOut.putVar(TIME_OUT);
     depthVarOut.putVar(DEPTH_OUT);
@@ -881,8 +1674,6 @@ int main(int argc, char **argv){
 
     //---------------------------------------------------------------
     // 6.4.1: Fill data (dependent) VARIABLES
-    //short shortSALT[ntime][depth_ind_range][lat_ind_range][lon_ind_range];
-    //short shortTEMP[ntime][depth_ind_range][lat_ind_range][lon_ind_range];
     
     vector<size_t> startp_write, countp_write;
     startp_write.push_back(0);
@@ -894,41 +1685,49 @@ int main(int argc, char **argv){
     countp_write.push_back(LAT_SIZE);
     countp_write.push_back(LON_SIZE);
 
-    for (int rec=0; rec<ntime; rec++){
-      startp_write[0] = rec;
-
-      short shortSALT[depth_ind_range][lat_ind_range][lon_ind_range];
-      short shortTEMP[depth_ind_range][lat_ind_range][lon_ind_range];
-
-      for (int i=0; i<depth_ind_range; i++){
-        for (int j=0; j<lat_ind_range; j++){
-          for (int k=0; k<lon_ind_range; k++){
-
-            if (TEMP[rec][i][j][k] != NO_VALUE)
-              //shortTEMP[rec][i][j][k] = (TEMP[rec][i][j][k]-ADD_OFFSET)
-              //  /SCALE_FACTOR;
-              shortTEMP[i][j][k] = (TEMP[rec][i][j][k]-ADD_OFFSET)
-                /SCALE_FACTOR;
-            else
-              //shortTEMP[rec][i][j][k] = NO_VALUE;
-              shortTEMP[i][j][k] = NO_VALUE;
-
-            if (SALT[rec][i][j][k] != NO_VALUE)
-              //shortSALT[rec][i][j][k] = (SALT[rec][i][j][k]-ADD_OFFSET)
-              //  /SCALE_FACTOR;
-              shortSALT[i][j][k] = (SALT[rec][i][j][k]-ADD_OFFSET)
-                /SCALE_FACTOR;
+    // One packed record buffer, reused for every record and variable;
+    // packed arrays are decoded one record at a time, and float arrays
+    // in another layout than the file's are reordered one at a time
+    const array_float4D *fields[2] = {&SALT, &TEMP};
+    NcVar *varsOut[2] = {&saltVarOut, &tempVarOut};
+    const PackedCube *cubes[2] = {&packedSALT, &packedTEMP};
+    AlignedBuffer<short> packed_rec(slab_size);
+    AlignedBuffer<float> decoded(slab_size);
+
+    // Write records [rec0, rec0+nrec), held in the arrays from 'first' on
+    auto writeRecords = [&](int rec0, int nrec, int first){
+      for (int r=0; r<nrec; r++){
+        startp_write[0] = rec0 + r;
+
+        for (int v=0; v<2; v++){
+          if (raw[v]){
+            varsOut[v]->putVar(startp_write,countp_write,
+                               cubes[v]->record(first+r));
+            continue;
+          }
+          const float *field = decoded;
+          if (packed)
+            cubes[v]->decodeRecord(first+r, decoded);
+          else
+            field = fields[v]->recordTZYX(first+r, decoded);
+          for (int n=0; n<slab_size; n++){
+            if (field[n] != NO_VALUE)
+              packed_rec[n] = (field[n]-ADD_OFFSET)/SCALE_FACTOR;
             else
-              //shortSALT[rec][i][j][k] = NO_VALUE;
-              shortSALT[i][j][k] = NO_VALUE;
-
+              packed_rec[n] = NO_VALUE;
           }
+          varsOut[v]->putVar(startp_write,countp_write,packed_rec.data());
         }
       }
+    };
 
-      saltVarOut.putVar(startp_write,countp_write,shortSALT);
-      tempVarOut.putVar(startp_write,countp_write,shortTEMP);
-    }
+    if (stream)
+      readData([&](int rec0, int nrec){
+          lock_guard<mutex> nc_lock(nc_mutex);
+          writeRecords(rec0, nrec, 0);
+        });
+    else
+      writeRecords(0, ntime, 0);
 
     cout << "-> Data variables written." << endl;
 
@@ -948,6 +1747,11 @@ int main(int argc, char **argv){
     cout << "*** [FAIL] ***" << endl;
     return NC_ERR;
   }
+  catch(exception &e){
+    cout << e.what() << endl;
+    cout << "*** [FAIL] ***" << endl;
+    return NC_ERR;
+  }
 }
 
 